@@ -0,0 +1,206 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stb_image_write.h"
+
+//Writes rendered frames in the background. Completed framebuffers are put into a bounded queue and
+//consumed by writer threads, so rendering continues while frames are encoded or written. Frames go
+//either to out_dir/frame_%03d.png (open_png, compressed by a set of encoder threads), or as raw RGBA
+//(ffmpeg's rawvideo with -pix_fmt rgba) into a file, named pipe, stdout (open_raw) or the stdin of a
+//child process such as ffmpeg (open_pipe). raw streams are written by a single thread to keep frames in
+//order. Framebuffers are recycled: acquire() hands out a buffer that a writer has finished with, so after
+//warming up no frame memory is allocated anymore. When the queue is full submit() either blocks until a
+//writer catches up or drops the frame.
+class FrameWriter {
+    struct Frame {
+        int index;
+        std::vector<uint32_t> pixels;
+    };
+
+    size_t w, h;
+    size_t capacity;     //maximum amount of frames waiting for an encoder
+    bool drop_when_full; //drop frames instead of blocking the renderer when the queue is full
+
+    std::mutex mtx;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Frame> queue;
+    std::vector<std::vector<uint32_t>> free_buffers;
+    std::vector<std::thread> encoders;
+    bool stopping = false;
+
+    std::string out_dir; //png output directory, empty for raw output
+    FILE* raw = nullptr; //raw output stream
+    bool raw_is_pipe = false;
+
+    size_t written = 0;
+    size_t failed = 0;
+    size_t dropped = 0;
+    size_t blocked = 0;  //amount of submit() calls that had to wait for a free queue slot
+    size_t max_depth = 0;
+    int next_index = 0;  //number of the next accepted frame, dropped frames don't use one up
+
+    bool write_frame(const Frame& frame) {
+        if (raw) {
+            if (fwrite(frame.pixels.data(), 4, w*h, raw) == w*h) return true;
+            std::cerr << "Failed to write raw frame " << frame.index << std::endl;
+            return false;
+        }
+        char fname[32];
+        snprintf(fname, sizeof(fname), "/frame_%03d.png", frame.index);
+        std::string path = out_dir + fname;
+        if (stbi_write_png(path.c_str(), w, h, 4, frame.pixels.data(), w*4)) return true;
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+
+    void start(int threads) {
+        for (int i = 0; i < threads; ++i) {
+            encoders.emplace_back(&FrameWriter::encoder_loop, this);
+        }
+    }
+
+    void encoder_loop() {
+        for (;;) {
+            Frame frame;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                not_empty.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                frame = std::move(queue.front());
+                queue.pop_front();
+            }
+            not_full.notify_one();
+
+            bool ok = write_frame(frame);
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if (ok) ++written; else ++failed;
+            free_buffers.push_back(std::move(frame.pixels));
+        }
+    }
+public:
+    struct Stats {
+        size_t queue_depth, max_depth, written, failed, dropped, blocked;
+    };
+
+    FrameWriter(size_t w, size_t h, size_t capacity, bool drop_when_full)
+        : w(w), h(h), capacity(std::max<size_t>(1, capacity)), drop_when_full(drop_when_full) {
+    }
+
+    //write frames as png files into out_dir using encoder_threads threads (0 means one per hardware thread)
+    bool open_png(const std::string& out_dir, int encoder_threads) {
+        assert(encoders.empty() && "FrameWriter is already open");
+        this->out_dir = out_dir;
+        if (encoder_threads <= 0) encoder_threads = std::max(1u, std::thread::hardware_concurrency());
+        start(encoder_threads);
+        return true;
+    }
+
+    //write raw frames into a file or named pipe, "-" is stdout
+    bool open_raw(const std::string& path) {
+        assert(encoders.empty() && "FrameWriter is already open");
+        raw = path == "-" ? stdout : fopen(path.c_str(), "wb");
+        if (!raw) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        start(1);
+        return true;
+    }
+
+    //write raw frames into the stdin of the shell command cmd
+    bool open_pipe(const std::string& cmd) {
+        assert(encoders.empty() && "FrameWriter is already open");
+        //a child that exits early must show up as a failed write rather than killing us
+        signal(SIGPIPE, SIG_IGN);
+        raw = popen(cmd.c_str(), "w");
+        if (!raw) {
+            std::cerr << "Failed to run " << cmd << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        raw_is_pipe = true;
+        start(1);
+        return true;
+    }
+
+    ~FrameWriter() {
+        finish();
+    }
+
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    //get a w*h buffer to render the next frame into
+    std::vector<uint32_t> acquire() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (free_buffers.empty()) return std::vector<uint32_t>(w*h);
+        std::vector<uint32_t> buf = std::move(free_buffers.back());
+        free_buffers.pop_back();
+        return buf;
+    }
+
+    //queue a frame obtained from acquire() for writing. accepted frames are numbered consecutively
+    //from 0, so the png files stay a gapless frame_%03d.png sequence even when frames are dropped
+    void submit(std::vector<uint32_t>&& pixels) {
+        assert(pixels.size() == w*h);
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (queue.size() >= capacity) {
+                if (drop_when_full) {
+                    ++dropped;
+                    free_buffers.push_back(std::move(pixels));
+                    return;
+                }
+                ++blocked;
+                not_full.wait(lock, [&] { return queue.size() < capacity; });
+            }
+            queue.push_back({next_index++, std::move(pixels)});
+            max_depth = std::max(max_depth, queue.size());
+        }
+        not_empty.notify_one();
+    }
+
+    //write out all queued frames, stop the writer threads and close the raw output. for a
+    //pipe this waits for the child process to exit, a failing child counts as a failed frame
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        for (auto& t : encoders) t.join();
+        encoders.clear();
+        if (!raw) return;
+        int status = 0;
+        if (raw_is_pipe) {
+            status = pclose(raw);
+        } else if (raw == stdout) {
+            status = fflush(raw);
+        } else {
+            status = fclose(raw);
+        }
+        raw = nullptr;
+        if (status) {
+            std::cerr << "Failed to finish raw output" << std::endl;
+            ++failed;
+        }
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return {queue.size(), max_depth, written, failed, dropped, blocked};
+    }
+};
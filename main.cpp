@@ -1,15 +1,30 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <string>
 #include <chrono>
 #include <thread>
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 #include <cstdint>
 #include <cassert>
-#define STB_IMAGE_IMPLEMENTATION
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#include "raycast.h"
+#include "thread_pool.h"
+#include "frame_writer.h"
 
 #include <SDL2/SDL.h>
 
@@ -25,12 +40,90 @@ void unpack_color(uint32_t c, uint8_t& r, uint8_t& g, uint8_t& b, uint8_t& a) {
     a = uint8_t((c >> 24) & 255);
 }
 
-void draw_tile(std::vector<uint32_t>& img, int w, int h, int tx, int ty, int tw, int th, uint32_t color) {
-    for (int i = tx; i < tx+tw; ++i) {
-        for (int j = ty; j < ty+th; ++j) {
-            if (i < 0 || i >= w || j < 0 || j >= h) continue;
-            img[i+j*w] = color;
-        }
+//a view of a w x h image of packed colors whose rows are pitch pixels apart. used to render either into
+//a std::vector (headless mode) or directly into locked texture memory which may have padded rows.
+struct FrameBuffer {
+    uint32_t* px;
+    int w, h;
+    int pitch;
+
+    uint32_t& operator()(int x, int y) {
+        return px[x + y*pitch];
+    }
+};
+
+//fill a rectangle. the rectangle is clipped to the image once, then every row is filled as one
+//contiguous span, which the compiler turns into wide stores
+void draw_tile(FrameBuffer& img, int tx, int ty, int tw, int th, uint32_t color) {
+    int x0 = std::max(tx, 0), x1 = std::min(tx+tw, img.w);
+    int y0 = std::max(ty, 0), y1 = std::min(ty+th, img.h);
+    if (x0 >= x1 || y0 >= y1) return;
+    for (int j = y0; j < y1; ++j) {
+        std::fill_n(&img(x0, j), x1-x0, color);
+    }
+}
+
+struct Tile {
+    int x, y, w, h;
+    uint32_t color;
+};
+
+//fill a batch of rectangles, later ones are drawn on top of earlier ones
+void draw_tiles(FrameBuffer& img, const std::vector<Tile>& tiles) {
+    for (const Tile& t : tiles) {
+        draw_tile(img, t.x, t.y, t.w, t.h, t.color);
+    }
+}
+
+//fill the triangle (x0,y0), (x1,y1), (x2,y2) with scanlines. a pixel is covered if its center lies
+//inside, so triangles sharing an edge neither overlap nor leave gaps. clipped to the image
+void fill_triangle(FrameBuffer& img, float x0, float y0, float x1, float y1, float x2, float y2, uint32_t color) {
+    //sort vertices by y
+    if (y1 < y0) { std::swap(x0, x1); std::swap(y0, y1); }
+    if (y2 < y0) { std::swap(x0, x2); std::swap(y0, y2); }
+    if (y2 < y1) { std::swap(x1, x2); std::swap(y1, y2); }
+    if (y2 <= y0) return;
+    int j0 = std::max(0, int(std::ceil(y0 - 0.5f)));
+    int j1 = std::min(img.h, int(std::ceil(y2 - 0.5f)));
+    for (int j = j0; j < j1; ++j) {
+        float y = j + 0.5f;
+        //x on the long edge (0-2) and on the short edge (0-1 above y1, 1-2 below)
+        float xa = x0 + (x2 - x0) * (y - y0) / (y2 - y0);
+        float xb = y < y1 ? x0 + (x1 - x0) * (y - y0) / (y1 - y0)
+                          : x1 + (x2 - x1) * (y - y1) / std::max(y2 - y1, 1e-6f);
+        if (xb < xa) std::swap(xa, xb);
+        int i0 = std::max(0, int(std::ceil(xa - 0.5f)));
+        int i1 = std::min(img.w, int(std::ceil(xb - 0.5f)));
+        if (i0 < i1) std::fill_n(&img(i0, j), i1 - i0, color);
+    }
+}
+
+//color of a texel of a packed or of a paletted atlas
+inline uint32_t texel_color(uint32_t texel, const uint32_t*) {
+    return texel;
+}
+
+inline uint32_t texel_color(uint8_t texel, const uint32_t* palette) {
+    return palette[texel];
+}
+
+//draw the texture column col (tex_h texels, consecutive texels are stride apart) stretched over the
+//rows [top, top+l) of screen column x. the span is clipped to the image up front and the texture is
+//walked with a 16.16 fixed point step, so the inner loop is a load, a store and two adds.
+//columns of a paletted atlas hold palette indices that are looked up in palette (e.g. a palette or a
+//row of a shade table), packed texels are drawn as they are
+template <typename Texel>
+void draw_column(FrameBuffer& img, int x, int top, int l, const Texel* col, int stride, int tex_h, const uint32_t* palette = nullptr) {
+    int j_begin = std::max(0, -top);
+    int j_end = std::min(l, img.h - top);
+    if (j_begin >= j_end) return;
+    uint32_t step = (uint32_t(tex_h) << 16) / l;
+    uint32_t pos = uint32_t((uint64_t(j_begin) * tex_h << 16) / l);
+    uint32_t* dst = &img(x, top + j_begin);
+    for (int j = j_begin; j < j_end; ++j) {
+        *dst = texel_color(col[(pos >> 16) * stride], palette);
+        dst += img.pitch;
+        pos += step;
     }
 }
 
@@ -50,6 +143,229 @@ class TextureAtlas {
 
     //storing input texture altas image pixel data in rgba
     std::vector<uint32_t> data;
+    //mip pyramid of every texture, level k is max(1, tex_w>>k) x max(1, tex_h>>k) texels, box filtered
+    //from level k-1. all textures of level k are stored one after the other from level_offset[k] on.
+    //when column_major is set every texture is stored column by column (a column is level_h[k] consecutive
+    //texels, walls are drawn one vertical column at a time so a wall column is a contiguous run) and the
+    //pyramid includes level 0, otherwise textures are stored row by row and level 0 is read from data.
+    bool column_major = false;
+    std::vector<uint32_t> mips;
+    std::vector<size_t> level_offset;
+    std::vector<int> level_w, level_h;
+    size_t mips_size = 0;//texels in the pyramid
+
+    //a paletted atlas keeps one byte per texel instead of a packed color: every texel of the atlas and of
+    //the pyramid is an index into a palette of 256 colors made for this atlas. index 0 is transparent.
+    //the atlas indices are followed by the pyramid indices, both laid out exactly like data and mips,
+    //which are released once the indices are made.
+    bool paletted = false;
+    std::vector<uint32_t> palette_data;
+    std::vector<uint8_t> index_data;
+
+    //texels are read through these, they point either into data/mips, palette_data/index_data or into
+    //a mapped atlas cache file
+    const uint32_t* pixels = nullptr;
+    const uint32_t* mip_pixels = nullptr;
+    const uint32_t* palette = nullptr;
+    const uint8_t* index_pixels = nullptr;
+    const uint8_t* index_mips = nullptr;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    //layout of an atlas cache file (see save_cache): the header, padded to 64 bytes, followed by the
+    //w*h atlas texels and the mips_size texels of the pyramid, both exactly as they are kept in memory.
+    //paletted atlases store the 256 palette colors followed by the index bytes instead.
+    //the file is in the native byte order of the machine that wrote it.
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        int32_t w, h, rows, cols;
+        uint32_t column_major;
+        uint32_t level_count;
+        uint32_t paletted;
+        uint64_t mips_size;
+    };
+    static const size_t cache_data_offset = 64;
+    static const uint32_t cache_version = 2;
+
+    //size of the texel data following the header of a cache file
+    size_t cache_data_size() const {
+        size_t texels = size_t(w) * h + mips_size;
+        return paletted ? palette_size * sizeof(uint32_t) + texels : texels * sizeof(uint32_t);
+    }
+
+    TextureAtlas() = default;
+
+    //index of texel (x,y) of texture t in level k
+    size_t mip_index(int k, int t, int x, int y) const {
+        size_t base = level_offset[k] + size_t(t) * level_w[k] * level_h[k];
+        return base + (column_major ? x * level_h[k] + y : y * level_w[k] + x);
+    }
+
+    //texel (x,y) of texture t in the atlas
+    uint32_t atlas_texel(int t, int x, int y) const {
+        return pixels[((t / cols) * tex_h + y) * w + (t % cols) * tex_w + x];
+    }
+
+    //texel (x,y) of texture t in level k, level 0 comes from the atlas when it is not part of the pyramid
+    uint32_t mip_texel(int k, int t, int x, int y) const {
+        if (k == 0 && !column_major) return atlas_texel(t, x, y);
+        return mip_pixels[mip_index(k, t, x, y)];
+    }
+
+    //average of 2x2 texels. colors are weighted by alpha so transparent texels do not bleed into
+    //their neighbours, texels that end up less than half covered become fully transparent
+    static uint32_t box_filter(const uint32_t* c) {
+        uint32_t r = 0, g = 0, b = 0, a = 0;
+        for (int i = 0; i < 4; ++i) {
+            uint8_t cr, cg, cb, ca;
+            unpack_color(c[i], cr, cg, cb, ca);
+            r += cr * ca; g += cg * ca; b += cb * ca; a += ca;
+        }
+        if (a < 2*255) return 0;
+        return pack_color(r / a, g / a, b / a, a / 4);
+    }
+
+    //build the pyramid of texture t, textures are independent of each other
+    void build_mips(int t) {
+        int first = column_major ? 0 : 1;
+        if (first == 0) {
+            for (int y = 0; y < tex_h; ++y) {
+                for (int x = 0; x < tex_w; ++x) {
+                    mips[mip_index(0, t, x, y)] = atlas_texel(t, x, y);
+                }
+            }
+            first = 1;
+        }
+        for (int k = first; k < int(level_offset.size()); ++k) {
+            int pw = level_w[k-1], ph = level_h[k-1];
+            for (int y = 0; y < level_h[k]; ++y) {
+                for (int x = 0; x < level_w[k]; ++x) {
+                    int x0 = std::min(2*x, pw-1), x1 = std::min(2*x+1, pw-1);
+                    int y0 = std::min(2*y, ph-1), y1 = std::min(2*y+1, ph-1);
+                    uint32_t c[4] = {mip_texel(k-1, t, x0, y0), mip_texel(k-1, t, x1, y0),
+                                     mip_texel(k-1, t, x0, y1), mip_texel(k-1, t, x1, y1)};
+                    mips[mip_index(k, t, x, y)] = box_filter(c);
+                }
+            }
+        }
+    }
+
+    //compute the level sizes and offsets of the pyramid, returns the amount of texels it takes
+    size_t layout_pyramid() {
+        level_offset.clear();
+        level_w.clear();
+        level_h.clear();
+        size_t size = 0;
+        for (int k = 0; ; ++k) {
+            level_w.push_back(std::max(1, tex_w >> k));
+            level_h.push_back(std::max(1, tex_h >> k));
+            level_offset.push_back(size);
+            if (k > 0 || column_major) size += size_t(tex_cnt) * level_w[k] * level_h[k];
+            if (level_w[k] == 1 && level_h[k] == 1) break;
+        }
+        mips_size = size;
+        return size;
+    }
+
+    //lay out the pyramid and build it, textures are spread over a few threads
+    void build_pyramid() {
+        mips.assign(layout_pyramid(), 0);
+        mip_pixels = mips.data();
+
+        int threads = std::min<int>(tex_cnt, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i, threads] {
+                for (int t = i; t < tex_cnt; t += threads) build_mips(t);
+            });
+        }
+        for (auto& worker : workers) worker.join();
+    }
+
+    //quantize the atlas and its pyramid to palette_size colors with median cut: starting from one box
+    //holding every opaque color, the box with the widest channel is split at the texel-weighted median of
+    //that channel until there are palette_size-1 boxes, each becoming the average color of its texels.
+    //texels with zero alpha map to index 0, every other texel becomes fully opaque, matching the samplers
+    //which draw any texel with nonzero alpha (box_filter already made pyramid texels that are less than
+    //half covered fully transparent). the packed texels are released afterwards
+    void quantize() {
+        const size_t atlas_size = size_t(w) * h;
+        std::unordered_map<uint32_t, uint32_t> histogram;
+        for (size_t i = 0; i < atlas_size; ++i) {
+            if (data[i] >> 24) ++histogram[data[i] & 0xFFFFFF];
+        }
+        for (size_t i = 0; i < mips_size; ++i) {
+            if (mips[i] >> 24) ++histogram[mips[i] & 0xFFFFFF];
+        }
+        std::vector<std::pair<uint32_t, uint32_t>> colors(histogram.begin(), histogram.end());//color, texel count
+        std::sort(colors.begin(), colors.end());
+
+        std::vector<std::pair<size_t, size_t>> boxes;//ranges of colors
+        if (!colors.empty()) boxes.push_back({0, colors.size()});
+        while (boxes.size() < size_t(palette_size - 1)) {
+            int best = -1, best_shift = 0, best_range = 0;
+            for (size_t b = 0; b < boxes.size(); ++b) {
+                for (int shift = 0; shift < 24; shift += 8) {
+                    int lo = 255, hi = 0;
+                    for (size_t i = boxes[b].first; i < boxes[b].second; ++i) {
+                        int v = (colors[i].first >> shift) & 255;
+                        lo = std::min(lo, v);
+                        hi = std::max(hi, v);
+                    }
+                    if (hi - lo > best_range) {
+                        best = int(b);
+                        best_shift = shift;
+                        best_range = hi - lo;
+                    }
+                }
+            }
+            if (best < 0) break;//every box holds a single color
+            size_t begin = boxes[best].first, end = boxes[best].second;
+            std::sort(colors.begin() + begin, colors.begin() + end, [best_shift](const std::pair<uint32_t, uint32_t>& a,
+                                                                                 const std::pair<uint32_t, uint32_t>& b) {
+                return ((a.first >> best_shift) & 255) < ((b.first >> best_shift) & 255);
+            });
+            uint64_t total = 0, below = 0;
+            for (size_t i = begin; i < end; ++i) total += colors[i].second;
+            size_t mid = begin + 1;
+            for (below = colors[begin].second; mid + 1 < end && (below + colors[mid].second) * 2 <= total; ++mid) {
+                below += colors[mid].second;
+            }
+            boxes[best].second = mid;
+            boxes.push_back({mid, end});
+        }
+
+        palette_data.assign(palette_size, 0);
+        std::unordered_map<uint32_t, uint8_t> lookup;
+        for (size_t b = 0; b < boxes.size(); ++b) {
+            uint64_t r = 0, g = 0, bl = 0, n = 0;
+            for (size_t i = boxes[b].first; i < boxes[b].second; ++i) {
+                uint8_t cr, cg, cb, ca;
+                unpack_color(colors[i].first, cr, cg, cb, ca);
+                r += uint64_t(cr) * colors[i].second;
+                g += uint64_t(cg) * colors[i].second;
+                bl += uint64_t(cb) * colors[i].second;
+                n += colors[i].second;
+                lookup[colors[i].first] = uint8_t(b + 1);
+            }
+            palette_data[b + 1] = pack_color(r / n, g / n, bl / n);
+        }
+
+        index_data.resize(atlas_size + mips_size);
+        for (size_t i = 0; i < atlas_size; ++i) {
+            index_data[i] = (data[i] >> 24) ? lookup[data[i] & 0xFFFFFF] : 0;
+        }
+        for (size_t i = 0; i < mips_size; ++i) {
+            index_data[atlas_size + i] = (mips[i] >> 24) ? lookup[mips[i] & 0xFFFFFF] : 0;
+        }
+        std::vector<uint32_t>().swap(data);
+        std::vector<uint32_t>().swap(mips);
+        pixels = mip_pixels = nullptr;
+        palette = palette_data.data();
+        index_pixels = index_data.data();
+        index_mips = index_pixels + atlas_size;
+    }
 
     //load image from file and initialze all data members.
     //the input image must have 4 channels (r,g,b,a). put
@@ -77,12 +393,125 @@ class TextureAtlas {
         }
 
         stbi_image_free(img_data);
+        pixels = data.data();
+        build_pyramid();
+        if (paletted) quantize();
     }
 public:
-    TextureAtlas(const char* filename, int rows, int cols) {
+    //amount of colors of the palette of a paletted atlas
+    static const int palette_size = 256;
+
+    //with column_major set, the textures are stored column by column for texture_column.
+    //with paletted set, the atlas is quantized to 256 colors, see texture_column_indices
+    TextureAtlas(const char* filename, int rows, int cols, bool column_major = false, bool paletted = false)
+        : column_major(column_major), paletted(paletted) {
         load_img(filename, rows, cols);
     }
 
+    ~TextureAtlas() {
+        if (mapping) munmap(mapping, mapping_size);
+    }
+
+    TextureAtlas(const TextureAtlas&) = delete;
+    TextureAtlas& operator=(const TextureAtlas&) = delete;
+
+    //write the atlas including its pyramid into a cache file that map_cache can load without decoding
+    bool save_cache(const char* fname) const {
+        CacheHeader hdr = {{'T', 'R', 'C', 'A'}, cache_version, w, h, rows, cols, column_major, uint32_t(level_count()), paletted, 0};
+        hdr.mips_size = mips_size;
+        char pad[cache_data_offset] = {};
+        std::ofstream out(fname, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        out.write(pad, cache_data_offset - sizeof(hdr));
+        if (paletted) {
+            out.write(reinterpret_cast<const char*>(palette), palette_size * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(index_pixels), size_t(w) * h);
+            out.write(reinterpret_cast<const char*>(index_mips), hdr.mips_size);
+        } else {
+            out.write(reinterpret_cast<const char*>(pixels), size_t(w) * h * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(mip_pixels), hdr.mips_size * sizeof(uint32_t));
+        }
+        if (!out) {
+            std::cerr << "Failed to write atlas cache " << fname << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    //map an atlas cache file written by save_cache into memory, texels are used straight from the
+    //mapping so loading does no decoding and no copying. returns nullptr if the file is missing or invalid
+    static std::unique_ptr<TextureAtlas> map_cache(const char* fname) {
+        int fd = open(fname, O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        void* mem = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= cache_data_offset) {
+            mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mem == MAP_FAILED) {
+            std::cerr << "Failed to map atlas cache " << fname << std::endl;
+            return nullptr;
+        }
+        std::unique_ptr<TextureAtlas> atlas(new TextureAtlas());
+        atlas->mapping = mem;
+        atlas->mapping_size = st.st_size;
+
+        CacheHeader hdr;
+        memcpy(&hdr, mem, sizeof(hdr));
+        bool valid = memcmp(hdr.magic, "TRCA", 4) == 0 && hdr.version == cache_version &&
+                     hdr.rows > 0 && hdr.cols > 0 && hdr.w % hdr.cols == 0 && hdr.h % hdr.rows == 0;
+        if (valid) {
+            atlas->w = hdr.w;
+            atlas->h = hdr.h;
+            atlas->c = 4;
+            atlas->rows = hdr.rows;
+            atlas->cols = hdr.cols;
+            atlas->tex_cnt = hdr.rows * hdr.cols;
+            atlas->tex_w = hdr.w / hdr.cols;
+            atlas->tex_h = hdr.h / hdr.rows;
+            atlas->column_major = hdr.column_major != 0;
+            atlas->paletted = hdr.paletted != 0;
+            size_t mips_size = atlas->layout_pyramid();
+            valid = mips_size == hdr.mips_size && size_t(atlas->level_count()) == hdr.level_count &&
+                    atlas->mapping_size == cache_data_offset + atlas->cache_data_size();
+        }
+        if (!valid) {
+            std::cerr << "Invalid atlas cache " << fname << std::endl;
+            return nullptr;
+        }
+        const char* texels = static_cast<const char*>(mem) + cache_data_offset;
+        if (atlas->paletted) {
+            atlas->palette = reinterpret_cast<const uint32_t*>(texels);
+            atlas->index_pixels = reinterpret_cast<const uint8_t*>(texels + palette_size * sizeof(uint32_t));
+            atlas->index_mips = atlas->index_pixels + size_t(hdr.w) * hdr.h;
+        } else {
+            atlas->pixels = reinterpret_cast<const uint32_t*>(texels);
+            atlas->mip_pixels = atlas->pixels + size_t(hdr.w) * hdr.h;
+        }
+        return atlas;
+    }
+
+    //true if the atlas was made from an image cut into rows x cols textures with the given storage
+    bool has_layout(int rows, int cols, bool column_major, bool paletted) const {
+        return this->rows == rows && this->cols == cols && this->column_major == column_major && this->paletted == paletted;
+    }
+
+    //bytes taken by the texels of the atlas and its pyramid
+    size_t memory_bytes() const {
+        return cache_data_size();
+    }
+
+    bool is_paletted() const {
+        return paletted;
+    }
+
+    //the palette_size colors of a paletted atlas
+    const uint32_t* palette_colors() const {
+        assert(paletted && "Atlas is not paletted");
+        return palette;
+    }
+
     size_t texture_count() {
         return tex_cnt;
     }
@@ -95,84 +524,1062 @@ public:
         return tex_h;
     }
 
+    int level_count() const {
+        return int(level_offset.size());
+    }
+
+    int level_height(int level) const {
+        return level_h[level];
+    }
+
+    //pick the mip level for a texture drawn l pixels high: the smallest level that still has at
+    //least one texel per pixel, so distant textures touch as few texels as possible without aliasing
+    int select_level(int l) const {
+        int level = 0;
+        while (level + 1 < level_count() && level_h[level + 1] >= l) ++level;
+        return level;
+    }
+
     //return texture color by the reference parameter 'color' indexed by
     //row(r) and column(c). the floating point numbers x, y are in range [0-1]
     //which indicates the coordinates inside the texture.
-    uint32_t texture_color(int r, int c, float x, float y) {
+    //an optional mip level can be given, see select_level.
+    uint32_t texture_color(int r, int c, float x, float y, int level = 0) {
         assert(r >= 0 && r < rows && "Row index out of range");
         assert(c >= 0 && c < cols && "Column index out of range");
         assert(x >= 0 && x <= 1 && "x must be in range [0, 1]");
         assert(y >= 0 && y <= 1 && "y must be in range [0, 1]");
+        assert(level >= 0 && level < level_count() && "Mip level out of range");
+
+        if (level == 0) {
+            int tex_x = static_cast<int>(x * tex_w);
+            int tex_y = static_cast<int>(y * tex_h);
+            int index = (r * tex_h + tex_y) * w + c * tex_w + tex_x;
+            return paletted ? palette[index_pixels[index]] : pixels[index];
+        }
+        int tex_x = std::min(level_w[level] - 1, static_cast<int>(x * level_w[level]));
+        int tex_y = std::min(level_h[level] - 1, static_cast<int>(y * level_h[level]));
+        size_t index = mip_index(level, r * cols + c, tex_x, tex_y);
+        return paletted ? palette[index_mips[index]] : mip_pixels[index];
+    }
+
+    //return a pointer to the top texel of the column at x (in range [0-1)) of mip level 'level' of the
+    //texture indexed by row(r) and column(c). the level_height(level) texels of that column follow
+    //column_stride(level) apart.
+    const uint32_t* texture_column(int r, int c, float x, int level = 0) const {
+        assert(!paletted && "Use texture_column_indices with paletted atlases");
+        assert(r >= 0 && r < rows && "Row index out of range");
+        assert(c >= 0 && c < cols && "Column index out of range");
+        assert(level >= 0 && level < level_count() && "Mip level out of range");
+        int tex_x = std::min(level_w[level] - 1, static_cast<int>(x * level_w[level]));
+        if (level == 0 && !column_major) return &pixels[r * tex_h * w + c * tex_w + tex_x];
+        return &mip_pixels[mip_index(level, r * cols + c, tex_x, 0)];
+    }
+
+    //texture_column for paletted atlases: the column holds indices into palette_colors()
+    const uint8_t* texture_column_indices(int r, int c, float x, int level = 0) const {
+        assert(paletted && "Atlas is not paletted");
+        assert(r >= 0 && r < rows && "Row index out of range");
+        assert(c >= 0 && c < cols && "Column index out of range");
+        assert(level >= 0 && level < level_count() && "Mip level out of range");
+        int tex_x = std::min(level_w[level] - 1, static_cast<int>(x * level_w[level]));
+        if (level == 0 && !column_major) return &index_pixels[r * tex_h * w + c * tex_w + tex_x];
+        return &index_mips[mip_index(level, r * cols + c, tex_x, 0)];
+    }
+
+    int column_stride(int level = 0) const {
+        if (column_major) return 1;
+        return level == 0 ? w : level_w[level];
+    }
+};
+
+//load an atlas through its cache file: the cache is mapped if it is at least as new as the image
+//and has the requested layout, otherwise the image is decoded and the cache is rewritten for next time
+std::unique_ptr<TextureAtlas> load_atlas(const char* image, const char* cache, int rows, int cols, bool column_major, bool paletted) {
+    struct stat image_st, cache_st;
+    if (stat(cache, &cache_st) == 0 && (stat(image, &image_st) != 0 || cache_st.st_mtime >= image_st.st_mtime)) {
+        std::unique_ptr<TextureAtlas> atlas = TextureAtlas::map_cache(cache);
+        if (atlas && atlas->has_layout(rows, cols, column_major, paletted)) return atlas;
+    }
+    std::unique_ptr<TextureAtlas> atlas(new TextureAtlas(image, rows, cols, column_major, paletted));
+    atlas->save_cache(cache);
+    return atlas;
+}
+
+//A texture atlas that may still be loading or that was evicted. get() returns nullptr until the atlas is
+//ready, meanwhile samplers draw every texture of the atlas in a flat placeholder color. The atlas is
+//published atomically, the renderer looks every atlas up once per frame (the wall atlas before the
+//column strips, a sprite atlas at the first sprite that needs it) so a frame never mixes both.
+//Samplers use use() instead of get() to let the TextureManager know the atlas was needed.
+class AtlasHandle {
+    std::unique_ptr<TextureAtlas> atlas;
+    std::atomic<TextureAtlas*> ready{nullptr};
+    std::vector<uint32_t> placeholders;
+    std::atomic<bool> used{false};
+public:
+    explicit AtlasHandle(const std::vector<uint32_t>& placeholders) : placeholders(placeholders) {
+    }
+
+    TextureAtlas* get() const {
+        return ready.load(std::memory_order_acquire);
+    }
+
+    uint32_t placeholder(int tex_id) const {
+        if (placeholders.empty()) return pack_color(128,128,128);
+        return placeholders[tex_id % placeholders.size()];
+    }
+
+    TextureAtlas* use() {
+        used.store(true, std::memory_order_relaxed);
+        return get();
+    }
+
+    //return whether the atlas was used since the last call
+    bool take_used() {
+        return used.exchange(false, std::memory_order_relaxed);
+    }
+
+    void set(std::unique_ptr<TextureAtlas> loaded) {
+        atlas = std::move(loaded);
+        ready.store(atlas.get(), std::memory_order_release);
+    }
+
+    //drop the atlas, must not be called while a frame is being rendered
+    void reset() {
+        ready.store(nullptr, std::memory_order_release);
+        atlas.reset();
+    }
+};
+
+//Decodes atlases on a few worker threads so that the first frames can be shown right away
+//and large texture packs load in parallel.
+class AtlasLoader {
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    std::condition_variable idle_cv;
+    std::deque<std::function<void()>> jobs;
+    int running = 0;
+    bool stopping = false;
+
+    void worker_loop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                work_cv.wait(lock, [&] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                ++running;
+            }
+            job();
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--running == 0 && jobs.empty()) idle_cv.notify_all();
+        }
+    }
+public:
+    //0 threads picks the hardware concurrency
+    explicit AtlasLoader(int threads = 0) {
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back(&AtlasLoader::worker_loop, this);
+        }
+    }
+
+    //finishes all queued loads
+    ~AtlasLoader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    AtlasLoader(const AtlasLoader&) = delete;
+    AtlasLoader& operator=(const AtlasLoader&) = delete;
+
+    //queue loading an atlas (see load_atlas) into handle
+    void load_into(const std::shared_ptr<AtlasHandle>& handle, const std::string& image, const std::string& cache,
+                   int rows, int cols, bool column_major, bool paletted) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.push_back([=] {
+                handle->set(load_atlas(image.c_str(), cache.c_str(), rows, cols, column_major, paletted));
+            });
+        }
+        work_cv.notify_one();
+    }
+
+    //queue loading an atlas and return its handle right away
+    std::shared_ptr<AtlasHandle> load(const std::string& image, const std::string& cache, int rows, int cols, bool column_major,
+                                      bool paletted, const std::vector<uint32_t>& placeholders) {
+        std::shared_ptr<AtlasHandle> handle = std::make_shared<AtlasHandle>(placeholders);
+        load_into(handle, image, cache, rows, cols, column_major, paletted);
+        return handle;
+    }
+
+    //block until every queued atlas is loaded
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        idle_cv.wait(lock, [&] { return jobs.empty() && running == 0; });
+    }
+};
+
+//Keeps the resident atlases within a memory budget. Every registered atlas has a handle that stays
+//valid for the whole run. Once per frame, after rendering, end_frame() collects which atlases the
+//samplers used: used atlases that are not resident count as misses and are (re)loaded in the background,
+//resident ones count as hits. Then least recently used atlases are evicted until the resident bytes
+//fit into the budget again, atlases used in the current frame are never evicted.
+class TextureManager {
+    struct Entry {
+        std::shared_ptr<AtlasHandle> handle;
+        std::string image, cache;
+        int rows, cols;
+        bool column_major, paletted;
+        bool loading;
+        uint64_t last_used;
+    };
+
+    AtlasLoader& loader;
+    size_t budget;//in bytes, 0 means unlimited
+    std::vector<Entry> entries;
+    uint64_t frame = 0;
+    size_t hits = 0, misses = 0, evictions = 0;
+public:
+    struct Stats {
+        size_t resident_bytes, budget, hits, misses, evictions;
+    };
+
+    TextureManager(AtlasLoader& loader, size_t budget) : loader(loader), budget(budget) {
+    }
 
-        int tex_x = static_cast<int>(x * tex_w);
-        int tex_y = static_cast<int>(y * tex_h);
-        int index = (r * tex_h + tex_y) * w + c * tex_w + tex_x;
-        return data[index];
+    //register an atlas and start loading it, see AtlasLoader::load
+    AtlasHandle* add(const std::string& image, const std::string& cache, int rows, int cols, bool column_major,
+                     bool paletted, const std::vector<uint32_t>& placeholders) {
+        Entry e = {loader.load(image, cache, rows, cols, column_major, paletted, placeholders), image, cache, rows, cols,
+                   column_major, paletted, true, frame};
+        entries.push_back(e);
+        return e.handle.get();
+    }
+
+    size_t resident_bytes() const {
+        size_t bytes = 0;
+        for (const Entry& e : entries) {
+            if (TextureAtlas* atlas = e.handle->get()) bytes += atlas->memory_bytes();
+        }
+        return bytes;
+    }
+
+    //call once per frame while no frame is being rendered
+    void end_frame() {
+        ++frame;
+        for (Entry& e : entries) {
+            TextureAtlas* atlas = e.handle->get();
+            if (atlas) e.loading = false;
+            if (!e.handle->take_used()) continue;
+            e.last_used = frame;
+            if (atlas) {
+                ++hits;
+                continue;
+            }
+            ++misses;
+            if (!e.loading) {
+                e.loading = true;
+                loader.load_into(e.handle, e.image, e.cache, e.rows, e.cols, e.column_major, e.paletted);
+            }
+        }
+        if (!budget) return;
+        size_t bytes = resident_bytes();
+        while (bytes > budget) {
+            Entry* lru = nullptr;
+            for (Entry& e : entries) {
+                if (!e.handle->get() || e.last_used == frame) continue;
+                if (!lru || e.last_used < lru->last_used) lru = &e;
+            }
+            if (!lru) break;
+            bytes -= lru->handle->get()->memory_bytes();
+            lru->handle->reset();
+            ++evictions;
+        }
+    }
+
+    Stats stats() const {
+        return {resident_bytes(), budget, hits, misses, evictions};
     }
 };
 
-struct Pawn {
-    float x, y;
-    TextureAtlas *texture;
-    int tex_id;
+//Uniform grid aligned to the map cells that lists the pawns standing in every cell, so the renderer only
+//visits pawns of cells it can see. Pawns are identified by their index. The pawns of a cell form a doubly
+//linked list threaded through per-pawn arrays: moving a pawn into another cell is O(1) and allocates
+//nothing. Positions outside of the map are kept in the nearest border cell.
+class PawnGrid {
+    int w = 0, h = 0;
+    std::vector<int> head;//first pawn of every cell, -1 for an empty cell
+    std::vector<int> next, prev, cell;//per pawn, -1 ends a list
+
+    int cell_at(float x, float y) const {
+        int cx = std::max(0, std::min(w - 1, int(std::floor(x))));
+        int cy = std::max(0, std::min(h - 1, int(std::floor(y))));
+        return cx + cy * w;
+    }
+
+    void link(int p, int c) {
+        cell[p] = c;
+        prev[p] = -1;
+        next[p] = head[c];
+        if (head[c] >= 0) prev[head[c]] = p;
+        head[c] = p;
+    }
+
+    void unlink(int p) {
+        if (prev[p] >= 0) next[prev[p]] = next[p]; else head[cell[p]] = next[p];
+        if (next[p] >= 0) prev[next[p]] = prev[p];
+    }
+public:
+    //an empty grid for a w x h map with room for pawns [0, capacity)
+    void reset(int w, int h, size_t capacity) {
+        this->w = w;
+        this->h = h;
+        head.assign(size_t(w) * h, -1);
+        reserve(capacity);
+    }
+
+    void reserve(size_t capacity) {
+        if (next.size() >= capacity) return;
+        next.resize(capacity);
+        prev.resize(capacity);
+        cell.resize(capacity);
+    }
+
+    void insert(int p, float x, float y) {
+        link(p, cell_at(x, y));
+    }
+
+    void remove(int p) {
+        unlink(p);
+    }
+
+    //pawn p moved to (x,y)
+    void move(int p, float x, float y) {
+        int c = cell_at(x, y);
+        if (c == cell[p]) return;
+        unlink(p);
+        link(p, c);
+    }
+
+    //pawn from is known as to from now on, to must not be in the grid
+    void rename(int from, int to) {
+        cell[to] = cell[from];
+        next[to] = next[from];
+        prev[to] = prev[from];
+        if (prev[to] >= 0) next[prev[to]] = to; else head[cell[to]] = to;
+        if (next[to] >= 0) prev[next[to]] = to;
+    }
+
+    //first pawn of cell (cx,cy), -1 if there is none
+    int first(int cx, int cy) const {
+        return head[cx + cy * w];
+    }
+
+    //the pawn after p in the same cell, -1 if p is the last one
+    int next_in_cell(int p) const {
+        return next[p];
+    }
+};
+
+//refers to a pawn of a PawnStore. a handle stays valid until its pawn is destroyed, after that it is
+//recognized as stale by its generation, even when the slot was reused for another pawn
+struct PawnHandle {
+    uint32_t slot;
+    uint32_t generation;
+};
+
+//The pawns of a scene stored as a structure of arrays: the size() live pawns are packed into [0, size())
+//of x(), y(), atlas() (an index into Scene::atlases) and tex_id(), so passes over all pawns such as
+//projection or culling run over contiguous arrays. Destroying a pawn moves the last pawn into its place,
+//pawns are referred to by handles that stay valid through such moves. The pawns are kept in a PawnGrid.
+//Storage for capacity pawns is allocated up front, creating and destroying pawns allocates nothing until
+//more than capacity pawns are alive at once.
+class PawnStore {
+    //per pawn
+    std::vector<float> xs, ys;
+    std::vector<int> atlases, tex_ids;
+    std::vector<uint32_t> slot_of;
+    //per slot
+    std::vector<uint32_t> pawn_of, generations;
+    std::vector<uint32_t> free_slots;
+    uint32_t slot_cnt = 0;
+    int n = 0;
+    PawnGrid index;
+
+    void grow(size_t capacity) {
+        xs.resize(capacity);
+        ys.resize(capacity);
+        atlases.resize(capacity);
+        tex_ids.resize(capacity);
+        slot_of.resize(capacity);
+        pawn_of.resize(capacity);
+        generations.resize(capacity);
+        free_slots.reserve(capacity);
+        index.reserve(capacity);
+    }
+public:
+    //remove all pawns, pawns live on a map_w x map_h map. handles issued before stay stale: the
+    //generation of every slot used so far is bumped, storage is never shrunk so none are lost
+    void reset(int map_w, int map_h, size_t capacity) {
+        for (uint32_t slot = 0; slot < slot_cnt; ++slot) ++generations[slot];
+        n = 0;
+        slot_cnt = 0;
+        free_slots.clear();
+        grow(std::max<size_t>({capacity, xs.size(), 1}));
+        index.reset(map_w, map_h, xs.size());
+    }
+
+    PawnHandle create(float x, float y, int atlas, int tex_id) {
+        if (size_t(n) == xs.size()) grow(xs.size() * 2);
+        uint32_t slot;
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot = slot_cnt++;
+        }
+        xs[n] = x;
+        ys[n] = y;
+        atlases[n] = atlas;
+        tex_ids[n] = tex_id;
+        slot_of[n] = slot;
+        pawn_of[slot] = n;
+        index.insert(n, x, y);
+        ++n;
+        return {slot, generations[slot]};
+    }
+
+    bool alive(PawnHandle h) const {
+        return h.slot < slot_cnt && generations[h.slot] == h.generation;
+    }
+
+    //the current index of the pawn of h, -1 if it was destroyed
+    int index_of(PawnHandle h) const {
+        return alive(h) ? int(pawn_of[h.slot]) : -1;
+    }
+
+    void destroy(PawnHandle h) {
+        if (!alive(h)) return;
+        int i = pawn_of[h.slot];
+        int last = n - 1;
+        index.remove(i);
+        if (i != last) {
+            xs[i] = xs[last];
+            ys[i] = ys[last];
+            atlases[i] = atlases[last];
+            tex_ids[i] = tex_ids[last];
+            slot_of[i] = slot_of[last];
+            pawn_of[slot_of[i]] = i;
+            index.rename(last, i);
+        }
+        ++generations[h.slot];
+        free_slots.push_back(h.slot);
+        --n;
+    }
+
+    //pawn i moved to (x,y)
+    void move(int i, float x, float y) {
+        xs[i] = x;
+        ys[i] = y;
+        index.move(i, x, y);
+    }
+
+    int size() const {
+        return n;
+    }
+
+    const float* x() const {
+        return xs.data();
+    }
+
+    const float* y() const {
+        return ys.data();
+    }
+
+    const int* atlas() const {
+        return atlases.data();
+    }
+
+    const int* tex_id() const {
+        return tex_ids.data();
+    }
+
+    const PawnGrid& grid() const {
+        return index;
+    }
 };
 
-void draw_sprite(std::vector<uint32_t>& img, int w, int h, std::vector<float>&depth, float dist, int tx, int ty, int tw, int th, TextureAtlas& tex, int tex_id) {
+//per-frame scratch of the sprite pass, kept by the renderer so drawing sprites allocates nothing.
+//sprites are drawn front to back, so a pixel belongs to the first sprite that puts an opaque texel
+//there. covered marks those pixels of the 3D view (column by column, h bytes per column). the rows
+//[solid_begin, solid_end) of a column are known to be fully covered, sprites whose column lies
+//inside skip the column without looking at a single pixel. only the rows sprites touched are cleared
+//for the next frame, a frame without visible sprites clears nothing
+struct SpriteScratch {
+    struct Visible {
+        float dist;
+        int foe;
+        float x, y, size;//top-left screen position and size of the sprite
+    };
+    int w = 0, h = 0;
+    std::vector<int> ids;//foes that may be visible
+    std::vector<float> x, y;//positions of those foes
+    std::vector<float> depth, u;//projected foe positions, see Camera::project
+    std::vector<Visible> visible;
+    std::vector<uint8_t> covered;
+    std::vector<int> solid_begin, solid_end;
+    std::vector<int> dirty_cols;//columns touched since the last clear
+    std::vector<int> dirty_begin, dirty_end;//rows of covered that may be set, per column
+    std::vector<TextureAtlas*> atlases;//sprite atlases of this frame, valid where atlas_seen is set
+    std::vector<uint8_t> atlas_seen;
+
+    void resize(int w, int h) {
+        this->w = w;
+        this->h = h;
+        covered.assign(size_t(w) * h, 0);
+        solid_begin.assign(w, 0);
+        solid_end.assign(w, 0);
+        dirty_begin.assign(w, 0);
+        dirty_end.assign(w, 0);
+        dirty_cols.clear();
+        dirty_cols.reserve(w);
+    }
+
+    //make room for n foes
+    void reserve(int n) {
+        if (int(x.size()) >= n) return;
+        x.resize(n);
+        y.resize(n);
+        depth.resize(n);
+        u.resize(n);
+        visible.reserve(n);
+    }
+
+    void clear() {
+        visible.clear();
+        for (int c : dirty_cols) {
+            std::fill(&covered[size_t(c) * h + dirty_begin[c]], &covered[size_t(c) * h + dirty_end[c]], 0);
+            solid_begin[c] = solid_end[c] = 0;
+            dirty_begin[c] = dirty_end[c] = 0;
+        }
+        dirty_cols.clear();
+    }
+
+    //a sprite is about to draw rows [begin, end) of column c
+    void touch(int c, int begin, int end) {
+        if (dirty_begin[c] >= dirty_end[c]) {
+            dirty_cols.push_back(c);
+            dirty_begin[c] = begin;
+            dirty_end[c] = end;
+        } else {
+            dirty_begin[c] = std::min(dirty_begin[c], begin);
+            dirty_end[c] = std::max(dirty_end[c], end);
+        }
+    }
+
+    //record that rows [begin, end) of column c are covered
+    void cover_span(int c, int begin, int end) {
+        if (begin <= solid_end[c] && solid_begin[c] <= end) {
+            solid_begin[c] = std::min(solid_begin[c], begin);
+            solid_end[c] = std::max(solid_end[c], end);
+        } else if (end - begin > solid_end[c] - solid_begin[c]) {
+            solid_begin[c] = begin;
+            solid_end[c] = end;
+        }
+    }
+};
+
+//draw rows [j_begin, j_end) of screen column x of a sprite whose top is at row ty and that is th rows
+//high, col is the texture column (tex_h texels, stride apart) walked with a 16.16 fixed point step like
+//draw_column. pixels already covered are left alone, opaque texels cover their pixel.
+//returns the amount of covered pixels in the span
+template <typename Texel>
+int draw_sprite_column(FrameBuffer& img, uint8_t* covered, int x, int ty, int th, int j_begin, int j_end,
+                       const Texel* col, int stride, int tex_h, const uint32_t* palette) {
+    uint32_t step = (uint32_t(tex_h) << 16) / th;
+    uint32_t pos = uint32_t((uint64_t(j_begin - ty) * tex_h << 16) / th);
+    uint32_t* dst = &img(x, j_begin);
+    int covered_cnt = 0;
+    for (int j = j_begin; j < j_end; ++j) {
+        if (!covered[j]) {
+            uint32_t color = texel_color(col[(pos >> 16) * stride], palette);
+            if (color & 0xFF000000) {
+                *dst = color;
+                covered[j] = 1;
+            }
+        }
+        covered_cnt += covered[j];
+        dst += img.pitch;
+        pos += step;
+    }
+    return covered_cnt;
+}
+
+//draw a sprite at distance dist into the 3D view (right half), sprites must be drawn front to back.
+//the sprite is drawn column by column: walls closer than dist hide whole columns, earlier sprites hide
+//the pixels they covered. the vertical span and the mip level are worked out once per sprite
+//tex is the atlas as looked up for this frame, nullptr while it is loading
+void draw_sprite(FrameBuffer& img, const std::vector<float>& depth, SpriteScratch& cover, float dist, int tx, int ty, int tw, int th,
+                 TextureAtlas* tex, const AtlasHandle& handle, int tex_id) {
+    const int w = img.w, h = img.h;
     auto left = std::max(w/2, std::min(tx, w));
     auto right = std::max(w/2, std::min(w, tx+tw));
     auto bottom = std::max(0, std::min(ty, h));
     auto top = std::max(0, std::min(ty+th, h));
+    if (bottom >= top || left >= right) return;
+    int level = tex ? tex->select_level(th) : 0;
+    int stride = tex ? tex->column_stride(level) : 0;
+    int tex_h = tex ? tex->level_height(level) : 0;
+    //a flat placeholder while the atlas is still loading
+    const uint32_t placeholder = handle.placeholder(tex_id);
     for (int i = left; i < right; ++i) {
-        for (int j = bottom; j < top; ++j) {
-            if (depth[i-w/2] < dist) continue;//w/2 because the 3D view is on the right part
-            depth[i-w/2] = dist;
-            float sample_x = (i-tx)/(float)tw;
-            float sample_y = (j-ty)/(float)th;
-            uint32_t color = tex.texture_color(0, tex_id, sample_x, sample_y);
-            if (color & 0xFF000000) img[i+j*w] = color;
+        const int c = i - w/2;//the 3D view is on the right part
+        if (depth[c] < dist) continue;
+        if (cover.solid_begin[c] <= bottom && top <= cover.solid_end[c]) continue;
+        cover.touch(c, bottom, top);
+        uint8_t* covered = &cover.covered[size_t(c) * h];
+        int covered_cnt;
+        float sample_x = (i-tx)/(float)tw;
+        if (!tex) {
+            covered_cnt = draw_sprite_column(img, covered, i, ty, th, bottom, top, &placeholder, 0, 1, nullptr);
+        } else if (tex->is_paletted()) {
+            covered_cnt = draw_sprite_column(img, covered, i, ty, th, bottom, top, tex->texture_column_indices(0, tex_id, sample_x, level),
+                                             stride, tex_h, tex->palette_colors());
+        } else {
+            covered_cnt = draw_sprite_column(img, covered, i, ty, th, bottom, top, tex->texture_column(0, tex_id, sample_x, level),
+                                             stride, tex_h, nullptr);
         }
+        if (covered_cnt == top - bottom) cover.cover_span(c, bottom, top);
+    }
+}
+
+//draw every foe on the map view
+void draw_foe_markers(FrameBuffer& fb, const PawnStore& foes) {
+    const int w = fb.w, h = fb.h;
+    for (int k = 0; k < foes.size(); ++k) {
+        auto mx = (foes.x()[k] / 16.0f) * (w/2.0f);
+        auto my = (foes.y()[k] / 16.0f) * h;
+        draw_tile(fb, int(mx-2), int(my-2), 4, 4, pack_color(255,255,255));
     }
 }
 
+//draw the foes listed in scratch.ids nearest first on the 3D view. foes are projected in one batch
+//through the camera the walls were cast with
 void draw_foes(
-    std::vector<uint32_t>&fb, int w, int h, 
-    std::vector<float>& depth,
-    std::vector<Pawn>& foes, 
+    FrameBuffer& fb,
+    const std::vector<float>& depth,
+    SpriteScratch& scratch,
+    const PawnStore& foes,
+    const std::vector<AtlasHandle*>& atlases,
     float player_x, float player_y,
-    float fov,
-    float player_a) {
-    for (auto& foe : foes) {
-        //draw foes on mini map
-        auto mx = (foe.x / 16.0f) * (w/2.0f);
-        auto my = (foe.y / 16.0f) * h;
-        draw_tile(fb, w, h, int(mx-2), int(my-2), 4, 4, pack_color(255,255,255));
-
-        //draw foe on 3D view
-        float foe_a = atan2(foe.y - player_y, foe.x - player_x);
-        //the angle between player_a which is the center of the view and the foe
-        float a = foe_a - player_a;
-        while (a > M_PI) a-= 2*M_PI;
-        while (a < -M_PI) a+= 2*M_PI;
-        //if player_a map to the center of 3D view
-        //then a is mapping to center + (a/fov)*win_w
-        float offset = w/4 + a*(w/2)/fov;//offset from the center of the 3D view
-        float sa = w/2 + offset;
-        //sa is the center screen coordinate of foe, to get the top-left of foe's texture:
-        float dist = sqrt(powf(foe.x-player_x, 2)+powf(foe.y-player_y, 2));
-        auto sw = std::min((float)h, h/dist);
-        auto sh = std::min((float)h, h/dist);;
-        auto sx = sa - sw/2.0f;
-        auto sy = h/2 - sh/2.0f;
-        if (sx+sw < w/2 || sx > w) continue;//outside of view cone
-        draw_sprite(fb, w, h, depth, dist, int(sx), int(sy), sw, sh, *foe.texture, foe.tex_id);
+    const Camera& camera) {
+    const int w = fb.w, h = fb.h;
+    const int n = int(scratch.ids.size());
+    scratch.clear();
+    scratch.reserve(n);
+    scratch.atlases.assign(atlases.size(), nullptr);
+    scratch.atlas_seen.assign(atlases.size(), 0);
+    for (int k = 0; k < n; ++k) {
+        scratch.x[k] = foes.x()[scratch.ids[k]];
+        scratch.y[k] = foes.y()[scratch.ids[k]];
+    }
+    camera.project(player_x, player_y, scratch.x.data(), scratch.y.data(), n, scratch.depth.data(), scratch.u.data());
+    for (int k = 0; k < n; ++k) {
+        //sized by the perpendicular distance like the walls
+        float dist = scratch.depth[k];
+        if (dist <= 0) continue;//behind the player
+        float sa = w/2 + (scratch.u[k] + 1.0f)*(w/4);//the center screen column of the foe
+        auto size = std::min((float)h, h/dist);
+        auto sx = sa - size/2.0f;
+        auto sy = h/2 - size/2.0f;
+        if (sx+size < w/2 || sx > w) continue;//outside of view cone
+        scratch.visible.push_back({dist, scratch.ids[k], sx, sy, size});
+    }
+    std::sort(scratch.visible.begin(), scratch.visible.end(), [](const SpriteScratch::Visible& a, const SpriteScratch::Visible& b) {
+        return a.dist < b.dist;
+    });
+    for (const SpriteScratch::Visible& v : scratch.visible) {
+        //every sprite of an atlas sees it in the same state, even if it is published during the frame
+        const int a = foes.atlas()[v.foe];
+        if (!scratch.atlas_seen[a]) {
+            scratch.atlas_seen[a] = 1;
+            scratch.atlases[a] = atlases[a]->use();
+        }
+        draw_sprite(fb, depth, scratch, v.dist, int(v.x), int(v.y), v.size, v.size, scratch.atlases[a], *atlases[a], foes.tex_id()[v.foe]);
     }
 }
 
-int main() {
+//everything about the world that is needed to simulate and render a frame
+struct Scene {
+    int map_w, map_h;
+    const char* map;
+    std::vector<uint32_t> ncolors;//minimap color of every wall type
+    AtlasHandle* wall;
+    std::vector<AtlasHandle*> atlases;//sprite atlases, pawns refer to them by index
+    PawnStore foes;
+
+    float player_x; // player x position in map space
+    float player_y; // player y position in map space
+    float player_a; // the angle between player direction and positive x-axis
+    float fov;
+
+    //bump whenever the content of map changes, the renderer rebuilds its cached map view then
+    unsigned map_revision = 0;
+};
+
+//update player position and facing, turn and walk are in [-1, 1]
+void update_player(Scene& scene, float turn, float walk, float dt) {
+    scene.player_a += turn * dt * 2.0f;
+    while (scene.player_a > M_PI) scene.player_a -= 2*M_PI;
+    while (scene.player_a < -M_PI) scene.player_a += 2*M_PI;
+
+    scene.player_x += walk * cosf(scene.player_a) * dt * 1.5f;
+    scene.player_y += walk * sinf(scene.player_a) * dt * 1.5f;
+}
+
+//Renders a scene into a framebuffer of win_w x win_h pixels: the minimap on the left half and the 3D view
+//on the right half. Owns all per-frame scratch buffers so that nothing is allocated while rendering.
+class Renderer {
+    size_t win_w, win_h;
+    ThreadPool& pool;
+    int strip_w;//width of the column strips handed out to the thread pool
+    std::vector<float> depth;
+    std::vector<float> ray_dx, ray_dy;
+    HitBuffer hits;
+    Camera camera;
+    SpriteScratch sprites;
+
+    //the static part of the map view (left), win_w/2 x win_h. rendered once and copied into every
+    //frame, rebuilt only when the map it was made from changes
+    std::vector<uint32_t> minimap;
+    int minimap_ray_stride = 4;//only every n-th ray is used for the visible area on the map view
+    const char* minimap_map = nullptr;
+    unsigned minimap_revision = 0;
+
+    //distance shading of paletted walls: row s of the shade table holds the wall palette blended towards
+    //the fog color by s/(shade_levels-1)*max_fog, so shading a texel is a single lookup. walls are fully
+    //shaded at fog_dist. rebuilt whenever the palette of the wall atlas changes
+    static const int shade_levels = 32;
+    float fog_dist = 16.0f;
+    float max_fog = 0.8f;
+    uint32_t fog_color = pack_color(60,60,60);
+    std::vector<uint32_t> shade_table;
+    std::vector<uint32_t> shade_palette;
+
+    void build_shade_table(const uint32_t* palette, int n) {
+        shade_palette.assign(palette, palette + n);
+        shade_table.resize(shade_levels * n);
+        uint8_t fr, fg, fb, fa;
+        unpack_color(fog_color, fr, fg, fb, fa);
+        for (int s = 0; s < shade_levels; ++s) {
+            float f = max_fog * s / (shade_levels - 1);
+            for (int i = 0; i < n; ++i) {
+                uint8_t r, g, b, a;
+                unpack_color(palette[i], r, g, b, a);
+                shade_table[s * n + i] = pack_color(uint32_t(r + (fr - r) * f), uint32_t(g + (fg - g) * f),
+                                                    uint32_t(b + (fb - b) * f), a);
+            }
+        }
+    }
+
+    void build_minimap(const Scene& scene) {
+        FrameBuffer layer = {minimap.data(), int(win_w/2), int(win_h), int(win_w/2)};
+        std::fill(minimap.begin(), minimap.end(), pack_color(60,60,60));
+        int tile_w = win_w/(scene.map_w*2);//the width of a tile
+        int tile_h = win_h/scene.map_h;//the height of a tile
+        std::vector<Tile> tiles;
+        for (int j = 0; j < scene.map_h; j++) {
+            for (int i = 0; i < scene.map_w; i++) {
+                char cell = scene.map[i+j*scene.map_w];
+                if (cell == ' ') continue;
+                tiles.push_back({i * tile_w, j * tile_h, tile_w, tile_h, scene.ncolors[cell-'0']});
+            }
+        }
+        draw_tiles(layer, tiles);
+        minimap_map = scene.map;
+        minimap_revision = scene.map_revision;
+    }
+    //collect the foes that may show up in the 3D view into sprites.ids, visiting only the cells the view
+    //can see: cells inside the bounding box of the area swept by this frame's rays, in front of the camera
+    //and not behind the walls of every column they project onto. cells are widened by the half width of a
+    //sprite, as a foe near the border of its cell reaches into the neighbouring cells
+    void gather_foes(const Scene& scene) {
+        const int cols = win_w/2;
+        const float ox = scene.player_x, oy = scene.player_y;
+        sprites.ids.clear();
+        float min_x = ox, max_x = ox, min_y = oy, max_y = oy;
+        for (int i = 0; i < cols; i++) {
+            float hx = ox + hits.dist[i]*ray_dx[i];
+            float hy = oy + hits.dist[i]*ray_dy[i];
+            min_x = std::min(min_x, hx);
+            max_x = std::max(max_x, hx);
+            min_y = std::min(min_y, hy);
+            max_y = std::max(max_y, hy);
+        }
+        //a sprite is win_h/dist pixels wide, a column is 2*tan(fov/2)*dist/cols map units wide at dist
+        const float radius = camera.tan_half() * win_h / cols;
+        int cx0 = std::max(0, int(std::floor(min_x - radius))), cx1 = std::min(scene.map_w - 1, int(std::floor(max_x + radius)));
+        int cy0 = std::max(0, int(std::floor(min_y - radius))), cy1 = std::min(scene.map_h - 1, int(std::floor(max_y + radius)));
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                int p = scene.foes.grid().first(cx, cy);
+                if (p < 0) continue;
+                float corner_x[4] = {cx - radius, cx + 1 + radius, cx - radius, cx + 1 + radius};
+                float corner_y[4] = {cy - radius, cy - radius, cy + 1 + radius, cy + 1 + radius};
+                float corner_depth[4], corner_u[4];
+                camera.project(ox, oy, corner_x, corner_y, 4, corner_depth, corner_u);
+                float near = corner_depth[0], far = corner_depth[0];
+                float u0 = corner_u[0], u1 = corner_u[0];
+                for (int k = 1; k < 4; k++) {
+                    near = std::min(near, corner_depth[k]);
+                    far = std::max(far, corner_depth[k]);
+                    u0 = std::min(u0, corner_u[k]);
+                    u1 = std::max(u1, corner_u[k]);
+                }
+                if (far <= 0) continue;//behind the player
+                int c0 = 0, c1 = cols - 1;
+                if (near > 0) {//otherwise the cell reaches behind the player and may cover any column
+                    if (u1 < -1.0f || u0 > 1.0f) continue;//outside of view cone
+                    c0 = std::max(0, int((u0 + 1.0f) * 0.5f * cols));
+                    c1 = std::min(cols - 1, int((u1 + 1.0f) * 0.5f * cols));
+                }
+                bool visible = false;
+                for (int c = c0; c <= c1 && !visible; c++) visible = depth[c] >= near;
+                if (!visible) continue;
+                for (; p >= 0; p = scene.foes.grid().next_in_cell(p)) sprites.ids.push_back(p);
+            }
+        }
+    }
+public:
+    Renderer(size_t win_w, size_t win_h, ThreadPool& pool) : win_w(win_w), win_h(win_h), pool(pool) {
+        const int cols = win_w/2;
+        //strips are a multiple of the widest ray packet, a few per thread so uneven columns balance out
+        strip_w = std::max(8, (cols / (pool.size()*4)) / 8 * 8);
+        depth.resize(cols, 10000.0f);
+        ray_dx.resize(cols);
+        ray_dy.resize(cols);
+        hits.resize(cols);
+        minimap.resize(cols*win_h);
+        sprites.resize(cols, win_h);
+    }
+
+    void render(Scene& scene, FrameBuffer& framebuffer) {
+        assert(framebuffer.w == int(win_w) && framebuffer.h == int(win_h));
+        const int map_w = scene.map_w;
+        const int map_h = scene.map_h;
+        const char* map = scene.map;
+        const int cols = win_w/2;//one ray per column of the 3D view
+        //every column of the 3D view and its depth entry is fully written by the shading stage,
+        //the map view (left) starts from a copy of the cached static map
+        if (minimap_map != map || minimap_revision != scene.map_revision) build_minimap(scene);
+        for (size_t j = 0; j < win_h; j++) {
+            memcpy(&framebuffer(0, j), &minimap[j*cols], cols*sizeof(uint32_t));
+        }
+#define map2win(X) int(X*win_w/((float)map_w*2.0f))
+        //draw player
+        int px = map2win(scene.player_x);//player x in window space
+        int py = map2win(scene.player_y);//player y in window space
+        draw_tile(framebuffer, px-2, py-2, 4, 4, pack_color(255,0,0));
+
+        //cast rays across fov centered around player_a. both the cast and the shading stage split
+        //the 3D view into column strips rendered on the thread pool, every strip only touches its own
+        //entries of the hit buffer, its own framebuffer columns and depth entries.
+        camera.setup(scene.fov, cols);
+        camera.update(scene.player_a);
+        //cast stage: fill the hit buffer, packets of neighbouring columns are cast at once
+        pool.parallel_for(cols, strip_w, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                camera.ray(i, ray_dx[i], ray_dy[i]);
+            }
+            cast_rays(map, map_w, map_h, scene.player_x, scene.player_y, &ray_dx[begin], &ray_dy[begin], end-begin, 20.0f, hits, begin);
+        });
+        //shading stage: one column of 3D view (right) per ray, the camera rays already give the perpendicular
+        //distance. the column is written from top to bottom: ceiling, wall and floor
+        TextureAtlas* wall = scene.wall->use();
+        const int palette_n = TextureAtlas::palette_size;
+        if (wall && wall->is_paletted() &&
+            (shade_palette.empty() || memcmp(shade_palette.data(), wall->palette_colors(), palette_n * sizeof(uint32_t)))) {
+            build_shade_table(wall->palette_colors(), palette_n);
+        }
+        pool.parallel_for(cols, strip_w, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const int x = win_w/2 + i;
+                if (hits.cell[i] < 0) {
+                    depth[i] = 10000.0f;
+                    for (size_t y = 0; y < win_h; y++) framebuffer(x, y) = pack_color(60,60,60);
+                    continue;
+                }
+                float dist = hits.dist[i];
+                depth[i] = dist;
+                //dist is 0 when the player stands inside a wall, l is clamped in float before it is converted
+                int l = int(std::min(2000.0f, win_h/std::max(dist, 1e-3f)));//prevent the l goes extremly big
+                int top = int(win_h/2) - l/2;//screen row of the top of the wall, may be offscreen
+                //rows [wall_begin, wall_end) show the wall, both are clamped to the column
+                int wall_begin = std::max(0, std::min(int(win_h), top));
+                int wall_end = std::max(wall_begin, std::min(int(win_h), top + l));
+                for (int y = 0; y < wall_begin; y++) framebuffer(x, y) = pack_color(60,60,60);
+                if (wall && wall->is_paletted()) {
+                    int level = wall->select_level(l);
+                    int shade = std::min(shade_levels - 1, int(dist / fog_dist * (shade_levels - 1)));
+                    const uint8_t* col = wall->texture_column_indices(0, hits.tex_id[i], hits.tex_x[i], level);
+                    draw_column(framebuffer, x, top, l, col, wall->column_stride(level), wall->level_height(level),
+                                &shade_table[shade * palette_n]);
+                } else if (wall) {
+                    int level = wall->select_level(l);
+                    const uint32_t* col = wall->texture_column(0, hits.tex_id[i], hits.tex_x[i], level);
+                    draw_column(framebuffer, x, top, l, col, wall->column_stride(level), wall->level_height(level));
+                } else {
+                    //wall textures are still loading
+                    uint32_t c = scene.wall->placeholder(hits.tex_id[i]);
+                    for (int y = wall_begin; y < wall_end; y++) framebuffer(x, y) = c;
+                }
+                for (int y = wall_end; y < int(win_h); y++) framebuffer(x, y) = pack_color(60,60,60);
+            }
+        });
+#undef map2win
+        //draw the visible area on map view (left) as a fan of triangles between the player and the hit points
+        //of every minimap_ray_stride-th ray. rays overlap on the map so this runs after the column strips are done
+        FrameBuffer mapview = {framebuffer.px, cols, int(win_h), framebuffer.pitch};
+        const float scale = win_w/(map_w*2.0f);//map space to window space
+        float eye_x = scene.player_x*scale, eye_y = scene.player_y*scale;
+        float prev_x = 0, prev_y = 0;
+        for (int i = 0; ; i = std::min(i + minimap_ray_stride, cols-1)) {
+            float hx = (scene.player_x + hits.dist[i]*ray_dx[i])*scale;
+            float hy = (scene.player_y + hits.dist[i]*ray_dy[i])*scale;
+            if (i > 0) fill_triangle(mapview, eye_x, eye_y, prev_x, prev_y, hx, hy, pack_color(170,170,170));
+            prev_x = hx;
+            prev_y = hy;
+            if (i == cols-1) break;
+        }
+        draw_foe_markers(framebuffer, scene.foes);
+        gather_foes(scene);
+        draw_foes(framebuffer, depth, sprites, scene.foes, scene.atlases, scene.player_x, scene.player_y, camera);
+    }
+};
+
+//output settings of the headless mode
+struct HeadlessOptions {
+    std::string out_dir = ".";
+    std::string raw_path;
+    std::string ffmpeg_out;
+    int encoders = 0;//0 means one per hardware thread
+    size_t queue = 8;
+    bool drop = false;
+};
+
+//quote s as a single word for /bin/sh: inside single quotes nothing is special except the closing
+//quote, every ' is written as '\'' (close, escaped quote, reopen)
+std::string shell_quote(const std::string& s) {
+    std::string quoted = "'";
+    for (char c : s) {
+        if (c == '\'') quoted += "'\\''"; else quoted += c;
+    }
+    return quoted + "'";
+}
+
+//render frames without a window and hand them to the frame writer. frames go to out_dir/frame_%03d.png,
+//or as raw rgba video to raw_path ("-" is stdout) or into an ffmpeg process encoding ffmpeg_out.
+//the player slowly turns around in place. used for throughput measurements and for making videos
+int run_headless(Renderer& renderer, Scene& scene, TextureManager& textures, size_t win_w, size_t win_h, int frames, const HeadlessOptions& opt) {
+    FrameWriter writer(win_w, win_h, opt.queue, opt.drop);
+    bool opened = false;
+    if (!opt.ffmpeg_out.empty()) {
+        std::ostringstream cmd;
+        cmd << "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgba -s " << win_w << "x" << win_h << " -r 15 -i - "
+            << "-vcodec libx264 -crf 23 -pix_fmt yuv420p " << shell_quote(opt.ffmpeg_out);
+        opened = writer.open_pipe(cmd.str());
+    } else if (!opt.raw_path.empty()) {
+        opened = writer.open_raw(opt.raw_path);
+    } else {
+        if (mkdir(opt.out_dir.c_str(), 0755) && errno != EEXIST) {
+            std::cerr << "Failed to create output directory " << opt.out_dir << ": " << strerror(errno) << std::endl;
+            return -1;
+        }
+        opened = writer.open_png(opt.out_dir, opt.encoders);
+    }
+    if (!opened) return -1;
+    auto start = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> render_time(0);
+    for (int frame = 0; frame < frames; ++frame) {
+        std::vector<uint32_t> framebuffer = writer.acquire();
+        auto t0 = std::chrono::high_resolution_clock::now();
+        update_player(scene, 1.0f, 0.0f, 1.0f/30.0f);
+        FrameBuffer fb = {framebuffer.data(), int(win_w), int(win_h), int(win_w)};
+        renderer.render(scene, fb);
+        render_time += std::chrono::high_resolution_clock::now() - t0;
+        writer.submit(std::move(framebuffer));
+        textures.end_frame();
+    }
+    writer.finish();
+    std::chrono::duration<double, std::milli> total_time = std::chrono::high_resolution_clock::now() - start;
+    FrameWriter::Stats st = writer.stats();
+    //stdout may be carrying the raw video, so report on stderr
+    std::clog << "rendered " << frames << " frames in " << render_time.count() << " ms ("
+              << frames*1000.0/render_time.count() << " fps), " << total_time.count() << " ms including writing" << std::endl;
+    std::clog << "written " << st.written << ", failed " << st.failed << ", dropped " << st.dropped
+              << ", blocked " << st.blocked << ", max queue depth " << st.max_depth << std::endl;
+    TextureManager::Stats ts = textures.stats();
+    std::clog << "textures: " << ts.resident_bytes << " bytes resident, " << ts.hits << " hits, " << ts.misses
+              << " misses, " << ts.evictions << " evictions" << std::endl;
+    return st.failed ? -1 : 0;
+}
+
+int main(int argc, char** argv) {
+    int threads = 0;//0 means one per hardware thread
+    bool headless = false;
+    int frames = 100;
+    HeadlessOptions headless_opt;
+    bool column_major = false;
+    bool paletted = false;
+    size_t texture_budget = 0;//in bytes, 0 means unlimited
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (arg == "--column-major") {
+            column_major = true;
+        } else if (arg == "--paletted") {
+            paletted = true;
+        } else if (arg == "--bake-atlas" && i+4 < argc) {
+            //convert an atlas image into a cache file that loads without decoding
+            TextureAtlas atlas(argv[i+1], atoi(argv[i+2]), atoi(argv[i+3]), column_major, paletted);
+            return atlas.save_cache(argv[i+4]) ? 0 : -1;
+        } else if (arg == "--texture-budget" && i+1 < argc) {
+            texture_budget = size_t(atof(argv[++i]) * 1024 * 1024);
+        } else if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--frames" && i+1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (arg == "--out" && i+1 < argc) {
+            headless_opt.out_dir = argv[++i];
+        } else if (arg == "--encoders" && i+1 < argc) {
+            headless_opt.encoders = atoi(argv[++i]);
+        } else if (arg == "--queue" && i+1 < argc) {
+            headless_opt.queue = atoi(argv[++i]);
+        } else if (arg == "--drop") {
+            headless_opt.drop = true;
+        } else if (arg == "--raw" && i+1 < argc) {
+            headless_opt.raw_path = argv[++i];
+        } else if (arg == "--ffmpeg" && i+1 < argc) {
+            headless_opt.ffmpeg_out = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--column-major] [--paletted] --bake-atlas image.png rows cols out.trca" << std::endl;
+            std::cerr << "       " << argv[0] << " [--threads N] [--texture-budget MB] [--paletted] [--headless [--frames N] [--out dir] [--encoders N] [--queue N] [--drop] [--raw path|-] [--ffmpeg out.mp4]]" << std::endl;
+            return -1;
+        }
+    }
+    ThreadPool pool(threads);
+
     const size_t win_w = 512*2;
     const size_t win_h = 512;
-    std::vector<uint32_t> framebuffer(win_w*win_h, pack_color(60,60,60));
-    std::vector<float> depth(win_w/2, 0.0f);
 
     const int map_w = 16;
     const int map_h = 16;
@@ -197,45 +1604,56 @@ int main() {
     //randomly picking n colors;
     srand(123456);
     std::vector<uint32_t> ncolors(10, 0);
-    for (int i = 0; i < ncolors.size(); i++) {
+    for (size_t i = 0; i < ncolors.size(); i++) {
         ncolors[i] = pack_color(rand()%255, rand()%255, rand()%255);
     }
 
-    //load wall texture
-    TextureAtlas wall("../walltext.png", 1, 6);
+    //textures are loaded in the background, walls show their minimap color until then
+    AtlasLoader loader;
+    TextureManager textures(loader, texture_budget);
+    //load wall texture, kept column-major as walls are drawn column by column
+    AtlasHandle* wall = textures.add("../walltext.png", "walltext.trca", 1, 6, true, paletted, ncolors);
     //monster texture
-    TextureAtlas monster("../monsters.png", 1, 4);
-
-    int tile_w = win_w/(map_w*2);//the width of a tile
-    int tile_h = win_h/map_h;//the height of a tile
+    AtlasHandle* monster = textures.add("../monsters.png", "monsters.trca", 1, 4, false, paletted, {pack_color(200,40,40)});
 
-    float player_x = 3.456; // player x position in map space
-    float player_y = 2.345; // player y position in map space
-    float player_a = M_PI / 2.05f; // the angle between player direction and positive x-axis
-    float fov = M_PI / 3.0f;
+    Scene scene;
+    scene.map_w = map_w;
+    scene.map_h = map_h;
+    scene.map = map;
+    scene.ncolors = ncolors;
+    scene.wall = wall;
+    scene.player_x = 3.456;
+    scene.player_y = 2.345;
+    scene.player_a = M_PI / 2.05f;
+    scene.fov = M_PI / 3.0f;
+    scene.atlases = {monster};
+    scene.foes.reset(map_w, map_h, 256);
+    scene.foes.create(5, 2, 0, 2);
+    scene.foes.create(1.834, 8.765, 0, 0);
+    scene.foes.create(2.834, 6.765, 0, 3);
+    scene.foes.create(5.323, 5.365, 0, 1);
+    scene.foes.create(4.123, 10.265, 0, 1);
 
-     std::vector<Pawn> foes = {
-        {5, 2, &monster, 2}, 
-        {1.834, 8.765, &monster, 0}, 
-        {2.834, 6.765, &monster, 3},
-        {5.323, 5.365, &monster, 1}, 
-        {4.123, 10.265, &monster, 1}};
-
-    
+    Renderer renderer(win_w, win_h, pool);
+    if (headless) {
+        //frames written to disk should show the actual textures
+        loader.wait();
+        return run_headless(renderer, scene, textures, win_w, win_h, frames, headless_opt);
+    }
     if (SDL_Init(SDL_INIT_VIDEO)) {
         std::cerr << "Failed to initialize SDL: " << SDL_GetError() << std::endl;
         return -1;
     }
 
     SDL_Window *window = nullptr;
-    SDL_Renderer *renderer = nullptr;
+    SDL_Renderer *sdl_renderer = nullptr;
 
-    if (SDL_CreateWindowAndRenderer(win_w, win_h, SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS, &window, &renderer)) {
+    if (SDL_CreateWindowAndRenderer(win_w, win_h, SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS, &window, &sdl_renderer)) {
         std::cerr << "Failed to create window and renderer: " << SDL_GetError() << std::endl;
         return -1;
     }
 
-    SDL_Texture *framebuffer_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, win_w, win_h);
+    SDL_Texture *framebuffer_texture = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, win_w, win_h);
     if (!framebuffer_texture) {
         std::cerr << "Failed to create SDL texture: " << SDL_GetError() << std::endl;
         return -1;
@@ -273,72 +1691,28 @@ int main() {
             }
         }
         float dt = elapsed_time.count() / 1000.0f;
-        //update player position and facing
-        player_a += player_turn * dt * 2.0f;
-        while (player_a > M_PI) player_a -= 2*M_PI;
-        while (player_a < -M_PI) player_a += 2*M_PI;
+        update_player(scene, player_turn, player_walk, dt);
 
-        player_x += player_walk * cosf(player_a) * dt * 1.5f;
-        player_y += player_walk * sinf(player_a) * dt * 1.5f;
-#define map2win(X) int(X*win_w/((float)map_w*2.0f))
-        //render
-        for (int i = 0; i < map_w; i++) {
-            for (int j = 0; j < map_h; j++) {
-                int tile_x = i * tile_w;
-                int tile_y = j * tile_h;
-                if (map[i+j*map_w] != ' ') {
-                    uint32_t c = ncolors[map[i+j*map_w]-'0'];
-                    draw_tile(framebuffer, win_w, win_h, tile_x, tile_y, tile_w, tile_h, c);
-                }
-                //draw player
-                int px = map2win(player_x);//player x in window space
-                int py = map2win(player_y);//player y in window space
-                draw_tile(framebuffer, win_w, win_h, px-2, py-2, 4, 4, pack_color(255,0,0));
-            }
+        //render straight into the texture memory, this saves copying a whole frame into the texture
+        void* pixels = nullptr;
+        int pitch = 0;
+        if (SDL_LockTexture(framebuffer_texture, NULL, &pixels, &pitch)) {
+            std::cerr << "Failed to lock SDL texture: " << SDL_GetError() << std::endl;
+            break;
         }
+        assert(pitch % 4 == 0 && "Texture rows must be aligned to whole pixels");
+        FrameBuffer framebuffer = {static_cast<uint32_t*>(pixels), int(win_w), int(win_h), pitch/4};
+        renderer.render(scene, framebuffer);
+        SDL_UnlockTexture(framebuffer_texture);
+        textures.end_frame();
 
-        //cast rays between fov
-        for (int i = 0; i < 512; i++) {
-            //cast 512 rays across fov centered around player_a
-            float a = player_a - fov/2.0f + (i / 512.f) * fov;
-            for (float c = 0.01/*prevent divide by 0 */; c < 20.0; c+=0.01f) {
-                float cx = player_x + c * cos(a);
-                float cy = player_y + c * sin(a);
-                //draw rays on map view (left)               
-                framebuffer[map2win(cx) + map2win(cy)*win_w] = pack_color(170,170,170);
-                //one ray generate one colum of 3D view (right)
-                if (map[int(cx)+int(cy)*map_w] != ' ') {
-                    float dist = c*cos(a-player_a);
-                    depth[i] = dist;
-                    int l = std::min(2000, int(win_h/dist));//prevent the l goes extremly big
-                    //check which kind of wall we are hitting
-                    auto gx = cx - floor(cx);
-                    auto gy = cy - floor(cy);
-                    bool vertical = int(cx + 0.01*cos(M_PI-a)) != int(cx);
-                    float tex_x = vertical ? gy: gx;
-
-                    for (int j = 0; j < l; j++) {
-                        if ((win_h/2 - l/2 + j) >= win_h) continue;
-                        uint32_t c = wall.texture_color(0, map[int(cx)+int(cy)*map_w]-'0', tex_x, j/(float)l);
-                        framebuffer[win_w/2 + i + (win_h/2 - l/2 + j)*win_w] = c;
-                    }
-                    break;
-                }
-            }
-        }
-        draw_foes(framebuffer, win_w, win_h, depth, foes, player_x, player_y, fov, player_a);
-
-        SDL_UpdateTexture(framebuffer_texture, NULL, reinterpret_cast<void*>(framebuffer.data()), win_w*4);
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, framebuffer_texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
-
-        std::fill(framebuffer.begin(), framebuffer.end(),  pack_color(60,60,60));
-        std::fill(depth.begin(), depth.end(),  10000.0f);
+        SDL_RenderClear(sdl_renderer);
+        SDL_RenderCopy(sdl_renderer, framebuffer_texture, NULL, NULL);
+        SDL_RenderPresent(sdl_renderer);
     }
 
     SDL_DestroyTexture(framebuffer_texture);
-    SDL_DestroyRenderer(renderer);
+    SDL_DestroyRenderer(sdl_renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
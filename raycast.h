@@ -0,0 +1,341 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+//result of casting a single ray through the map grid.
+struct RayHit {
+    bool hit;       //false if the ray left the map or exceeded max_dist
+    float dist;     //ray parameter at the hit point, in units of the direction length
+                    //(equals euclidean distance when the direction is normalized). 0 when the
+                    //origin lies in a wall cell or on the boundary of one it points into
+    int cell_x, cell_y; //map cell that stopped the ray
+    char cell;      //content of that cell
+    bool vertical;  //true if the ray hit a vertical (x = const) cell boundary
+    float tex_x;    //fractional position along the wall face, in range [0-1)
+};
+
+//Structure-of-arrays storage for the cast results of a whole view, one entry per column.
+//The cast stage fills it, later stages (wall shading, minimap, sprites) only read from it.
+struct HitBuffer {
+    std::vector<float> dist;      //see RayHit::dist, max_dist if nothing was hit
+    std::vector<int> cell;        //index (x + y*map_w) of the map cell that was hit, -1 if nothing was hit
+    std::vector<uint8_t> tex_id;  //wall texture of the hit cell (cell content - '0')
+    std::vector<float> tex_x;     //see RayHit::tex_x
+    std::vector<uint8_t> side;    //1 if a vertical cell boundary was hit, 0 otherwise
+
+    void resize(int n) {
+        dist.resize(n);
+        cell.resize(n);
+        tex_id.resize(n);
+        tex_x.resize(n);
+        side.resize(n);
+    }
+
+    int size() const {
+        return int(dist.size());
+    }
+
+    void store(int i, const RayHit& h, int map_w) {
+        dist[i] = h.dist;
+        cell[i] = h.hit ? h.cell_x + h.cell_y * map_w : -1;
+        tex_id[i] = h.hit ? uint8_t(h.cell - '0') : 0;
+        tex_x[i] = h.tex_x;
+        side[i] = h.vertical;
+    }
+};
+
+//fill in the parts of a RayHit that are shared between the scalar and the packet casters
+//once the traversal has found the cell that stops the ray.
+inline void finish_hit(RayHit& res, const char* map, int map_w, float ox, float oy, float dx, float dy, float t, int mx, int my, bool vertical) {
+    float u = vertical ? oy + t * dy : ox + t * dx;
+    res.hit = true;
+    res.dist = t;
+    res.cell_x = mx;
+    res.cell_y = my;
+    res.cell = map[mx + my * map_w];
+    res.vertical = vertical;
+    res.tex_x = u - std::floor(u);
+}
+
+//walk the ray (ox,oy)+t*(dx,dy) cell by cell through the map using a DDA.
+//every iteration steps exactly to the next cell boundary, so the cost is
+//proportional to the amount of cells crossed rather than to the distance.
+//any non-space cell is treated as a wall.
+inline RayHit cast_ray(const char* map, int map_w, int map_h, float ox, float oy, float dx, float dy, float max_dist) {
+    RayHit res = {false, max_dist, 0, 0, ' ', false, 0.0f};
+    int mx = int(std::floor(ox));
+    int my = int(std::floor(oy));
+    //distance (in t) needed to cross one full cell along each axis
+    float delta_x = dx != 0.0f ? std::fabs(1.0f / dx) : INFINITY;
+    float delta_y = dy != 0.0f ? std::fabs(1.0f / dy) : INFINITY;
+    int step_x = dx < 0 ? -1 : 1;
+    int step_y = dy < 0 ? -1 : 1;
+    //distance (in t) to the first cell boundary along each axis
+    float side_x = dx < 0 ? (ox - mx) * delta_x : (mx + 1.0f - ox) * delta_x;
+    float side_y = dy < 0 ? (oy - my) * delta_y : (my + 1.0f - oy) * delta_y;
+
+    float t = 0.0f;
+    bool vertical = false;
+    while (t < max_dist) {
+        if (mx < 0 || mx >= map_w || my < 0 || my >= map_h) return res;
+        if (map[mx + my * map_w] != ' ') {
+            finish_hit(res, map, map_w, ox, oy, dx, dy, t, mx, my, vertical);
+            return res;
+        }
+        if (side_x < side_y) {
+            t = side_x;
+            side_x += delta_x;
+            mx += step_x;
+            vertical = true;
+        } else {
+            t = side_y;
+            side_y += delta_y;
+            my += step_y;
+            vertical = false;
+        }
+    }
+    return res;
+}
+
+typedef void (*CastRaysFn)(const char*, int, int, float, float, const float*, const float*, int, float, HitBuffer&, int);
+
+inline void cast_rays_scalar(const char* map, int map_w, int map_h, float ox, float oy, const float* dx, const float* dy, int n, float max_dist, HitBuffer& out, int first) {
+    for (int i = 0; i < n; ++i) {
+        out.store(first + i, cast_ray(map, map_w, map_h, ox, oy, dx[i], dy[i], max_dist), map_w);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//packet caster: 8 neighbouring rays are traced together, one ray per AVX2 lane, and a partial packet at
+//the end of the input is padded by repeating its last ray. the whole traversal stays in registers: the
+//cells of all lanes are fetched with one gather per step, the wall test runs on the gathered values and
+//lanes that stopped are masked out until every lane has stopped. only the final hits are finished per lane. the map is a char grid, so every lane gathers the aligned
+//32 bit word holding its cell and shifts the cell byte out of it. an aligned word never crosses a page
+//boundary, so the at most 3 bytes read around the map are harmless.
+__attribute__((target("avx2")))
+inline void cast_rays_avx2(const char* map, int map_w, int map_h, float ox, float oy, const float* dx, const float* dy, int n, float max_dist, HitBuffer& out, int first) {
+    const int N = 8;
+    int mx0 = int(std::floor(ox));
+    int my0 = int(std::floor(oy));
+    const int misalign = int(reinterpret_cast<uintptr_t>(map) & 3);
+    const int* words = reinterpret_cast<const int*>(map - misalign);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 vmax = _mm256_set1_ps(max_dist);
+    const __m256 fx_lo = _mm256_set1_ps(ox - mx0), fx_hi = _mm256_set1_ps(mx0 + 1.0f - ox);
+    const __m256 fy_lo = _mm256_set1_ps(oy - my0), fy_hi = _mm256_set1_ps(my0 + 1.0f - oy);
+    const __m256i vmap_w = _mm256_set1_epi32(map_w), vmap_h = _mm256_set1_epi32(map_h);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i vmisalign = _mm256_set1_epi32(misalign);
+    const __m256i byte_mask = _mm256_set1_epi32(255), space = _mm256_set1_epi32(' ');
+    alignas(32) float pdx[N], pdy[N], t[N];
+    alignas(32) int mx[N], my[N], vertical[N], hit[N];
+    for (int i = 0; i < n; i += N) {
+        int cnt = std::min(N, n - i);
+        for (int k = 0; k < N; ++k) {
+            pdx[k] = dx[i + std::min(k, cnt - 1)];
+            pdy[k] = dy[i + std::min(k, cnt - 1)];
+        }
+        __m256 vdx = _mm256_load_ps(pdx), vdy = _mm256_load_ps(pdy);
+        __m256 delta_x = _mm256_and_ps(_mm256_div_ps(one, vdx), abs_mask);
+        __m256 delta_y = _mm256_and_ps(_mm256_div_ps(one, vdy), abs_mask);
+        __m256 neg_x = _mm256_cmp_ps(vdx, zero, _CMP_LT_OQ), neg_y = _mm256_cmp_ps(vdy, zero, _CMP_LT_OQ);
+        __m256i step_x = _mm256_or_si256(_mm256_castps_si256(neg_x), _mm256_set1_epi32(1));
+        __m256i step_y = _mm256_or_si256(_mm256_castps_si256(neg_y), _mm256_set1_epi32(1));
+        __m256 side_x = _mm256_mul_ps(_mm256_blendv_ps(fx_hi, fx_lo, neg_x), delta_x);
+        __m256 side_y = _mm256_mul_ps(_mm256_blendv_ps(fy_hi, fy_lo, neg_y), delta_y);
+        __m256 vt = zero;
+        __m256i vmx = _mm256_set1_epi32(mx0), vmy = _mm256_set1_epi32(my0), vvert = _mm256_setzero_si256();
+        //state of every lane when it stopped
+        __m256 rt = zero;
+        __m256i rmx = vmx, rmy = vmy, rvert = vvert, rhit = _mm256_setzero_si256();
+        __m256i active = minus_one;
+        for (;;) {
+            //lanes still inside the map and below max_dist look up their cell
+            __m256i inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(vmx, minus_one), _mm256_cmpgt_epi32(vmap_w, vmx)),
+                                              _mm256_and_si256(_mm256_cmpgt_epi32(vmy, minus_one), _mm256_cmpgt_epi32(vmap_h, vmy)));
+            __m256i go = _mm256_and_si256(_mm256_and_si256(active, inside), _mm256_castps_si256(_mm256_cmp_ps(vt, vmax, _CMP_LT_OQ)));
+            __m256i offset = _mm256_add_epi32(_mm256_add_epi32(vmx, _mm256_mullo_epi32(vmy, vmap_w)), vmisalign);
+            __m256i word = _mm256_mask_i32gather_epi32(space, words, _mm256_srli_epi32(offset, 2), go, 4);
+            __m256i shift = _mm256_slli_epi32(_mm256_and_si256(offset, _mm256_set1_epi32(3)), 3);
+            __m256i cell = _mm256_and_si256(_mm256_srlv_epi32(word, shift), byte_mask);
+            __m256i wall = _mm256_andnot_si256(_mm256_cmpeq_epi32(cell, space), go);
+            //lanes that left the map, went past max_dist or hit a wall stop here
+            __m256i stop = _mm256_or_si256(_mm256_andnot_si256(go, active), wall);
+            rt = _mm256_blendv_ps(rt, vt, _mm256_castsi256_ps(stop));
+            rmx = _mm256_blendv_epi8(rmx, vmx, stop);
+            rmy = _mm256_blendv_epi8(rmy, vmy, stop);
+            rvert = _mm256_blendv_epi8(rvert, vvert, stop);
+            rhit = _mm256_or_si256(rhit, wall);
+            active = _mm256_andnot_si256(stop, active);
+            if (_mm256_testz_si256(active, active)) break;
+            __m256 take_x = _mm256_cmp_ps(side_x, side_y, _CMP_LT_OQ);
+            __m256i take_xi = _mm256_castps_si256(take_x);
+            vt = _mm256_blendv_ps(side_y, side_x, take_x);
+            side_x = _mm256_add_ps(side_x, _mm256_and_ps(take_x, delta_x));
+            side_y = _mm256_add_ps(side_y, _mm256_andnot_ps(take_x, delta_y));
+            vmx = _mm256_add_epi32(vmx, _mm256_and_si256(take_xi, step_x));
+            vmy = _mm256_add_epi32(vmy, _mm256_andnot_si256(take_xi, step_y));
+            vvert = take_xi;
+        }
+        _mm256_store_ps(t, rt);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(mx), rmx);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(my), rmy);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(vertical), rvert);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(hit), rhit);
+        for (int k = 0; k < cnt; ++k) {
+            RayHit res = {false, max_dist, 0, 0, ' ', false, 0.0f};
+            if (hit[k]) finish_hit(res, map, map_w, ox, oy, pdx[k], pdy[k], t[k], mx[k], my[k], vertical[k] != 0);
+            out.store(first + i + k, res, map_w);
+        }
+    }
+}
+#endif
+
+//pick the packet caster if the running cpu supports it. the choice is made once on first use.
+//there is no SSE2 caster, without a gather the per-lane map lookups lose against the scalar one.
+inline CastRaysFn select_cast_rays() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return cast_rays_avx2;
+#endif
+    return cast_rays_scalar;
+}
+
+//cast n rays from the common origin (ox,oy) with directions (dx[i],dy[i]) into entries [first, first+n)
+//of out. results are identical to calling cast_ray for every direction.
+inline void cast_rays(const char* map, int map_w, int map_h, float ox, float oy, const float* dx, const float* dy, int n, float max_dist, HitBuffer& out, int first) {
+    static const CastRaysFn impl = select_cast_rays();
+    impl(map, map_w, map_h, ox, oy, dx, dy, n, max_dist, out, first);
+}
+
+//Point projection into a camera at (ox,oy) with view direction (dir_x,dir_y) and the perpendicular
+//plane (plane_x,plane_y): depth[i] = rel.dir is the distance in front of the camera plane (<= 0 behind
+//the camera) and u[i] = rel.plane / (depth[i]*half) the position across the view, -1 at the left and
+//1 at the right edge, where rel is the point relative to the camera and half = tan(fov/2). this
+//inverts the camera basis the rays are made from, a point on the ray of a column projects onto
+//that column. u is not meaningful for points behind the camera.
+typedef void (*ProjectPointsFn)(float, float, float, float, float, float, float, const float*, const float*, int, float*, float*);
+
+inline void project_points_scalar(float ox, float oy, float dir_x, float dir_y, float plane_x, float plane_y, float half,
+                                  const float* x, const float* y, int n, float* depth, float* u) {
+    for (int i = 0; i < n; ++i) {
+        float rx = x[i] - ox, ry = y[i] - oy;
+        float d = rx * dir_x + ry * dir_y;
+        depth[i] = d;
+        u[i] = (rx * plane_x + ry * plane_y) / (d * half);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//the same with one point per SIMD lane, a partial batch at the end is left to the scalar version
+__attribute__((target("sse2")))
+inline void project_points_sse2(float ox, float oy, float dir_x, float dir_y, float plane_x, float plane_y, float half,
+                                const float* x, const float* y, int n, float* depth, float* u) {
+    const int N = 4;
+    const __m128 vox = _mm_set1_ps(ox), voy = _mm_set1_ps(oy);
+    const __m128 vdx = _mm_set1_ps(dir_x), vdy = _mm_set1_ps(dir_y);
+    const __m128 vpx = _mm_set1_ps(plane_x), vpy = _mm_set1_ps(plane_y);
+    const __m128 vhalf = _mm_set1_ps(half);
+    int i = 0;
+    for (; i + N <= n; i += N) {
+        __m128 rx = _mm_sub_ps(_mm_loadu_ps(x + i), vox);
+        __m128 ry = _mm_sub_ps(_mm_loadu_ps(y + i), voy);
+        __m128 d = _mm_add_ps(_mm_mul_ps(rx, vdx), _mm_mul_ps(ry, vdy));
+        __m128 p = _mm_add_ps(_mm_mul_ps(rx, vpx), _mm_mul_ps(ry, vpy));
+        _mm_storeu_ps(depth + i, d);
+        _mm_storeu_ps(u + i, _mm_div_ps(p, _mm_mul_ps(d, vhalf)));
+    }
+    project_points_scalar(ox, oy, dir_x, dir_y, plane_x, plane_y, half, x + i, y + i, n - i, depth + i, u + i);
+}
+
+__attribute__((target("avx2")))
+inline void project_points_avx2(float ox, float oy, float dir_x, float dir_y, float plane_x, float plane_y, float half,
+                                const float* x, const float* y, int n, float* depth, float* u) {
+    const int N = 8;
+    const __m256 vox = _mm256_set1_ps(ox), voy = _mm256_set1_ps(oy);
+    const __m256 vdx = _mm256_set1_ps(dir_x), vdy = _mm256_set1_ps(dir_y);
+    const __m256 vpx = _mm256_set1_ps(plane_x), vpy = _mm256_set1_ps(plane_y);
+    const __m256 vhalf = _mm256_set1_ps(half);
+    int i = 0;
+    for (; i + N <= n; i += N) {
+        __m256 rx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vox);
+        __m256 ry = _mm256_sub_ps(_mm256_loadu_ps(y + i), voy);
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(rx, vdx), _mm256_mul_ps(ry, vdy));
+        __m256 p = _mm256_add_ps(_mm256_mul_ps(rx, vpx), _mm256_mul_ps(ry, vpy));
+        _mm256_storeu_ps(depth + i, d);
+        _mm256_storeu_ps(u + i, _mm256_div_ps(p, _mm256_mul_ps(d, vhalf)));
+    }
+    project_points_scalar(ox, oy, dir_x, dir_y, plane_x, plane_y, half, x + i, y + i, n - i, depth + i, u + i);
+}
+#endif
+
+inline ProjectPointsFn select_project_points() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return project_points_avx2;
+    if (__builtin_cpu_supports("sse2")) return project_points_sse2;
+#endif
+    return project_points_scalar;
+}
+
+//Camera-plane description of the view: a ray for column i points along dir + plane * offset[i].
+//The per column offsets only depend on the fov and the amount of columns, so they are computed once
+//and reused until one of those changes, turning the camera then costs a single sin/cos per frame.
+//Ray directions are not normalized, their component along dir is always 1, hence the distance
+//reported by cast_ray is already the perpendicular (fish-eye corrected) distance to the wall.
+class Camera {
+    float fov = 0.0f;
+    int width = 0;
+    float half = 0.0f;//tan(fov/2)
+    std::vector<float> offsets; //position of every column on the camera plane, in [-tan(fov/2), tan(fov/2))
+public:
+    float dir_x = 1.0f, dir_y = 0.0f;  //unit view direction
+    float plane_x = 0.0f, plane_y = 1.0f;//unit vector perpendicular to dir, pointing to the right of the view
+
+    //(re)build the per column offsets when fov or width changed
+    void setup(float fov, int width) {
+        if (fov == this->fov && width == this->width) return;
+        this->fov = fov;
+        this->width = width;
+        offsets.resize(width);
+        half = std::tan(fov / 2.0f);
+        for (int i = 0; i < width; ++i) {
+            offsets[i] = half * (2.0f * i / width - 1.0f);
+        }
+    }
+
+    //point the camera along angle a (between view direction and the positive x-axis)
+    void update(float a) {
+        dir_x = std::cos(a);
+        dir_y = std::sin(a);
+        plane_x = -dir_y;
+        plane_y = dir_x;
+    }
+
+    int columns() const {
+        return width;
+    }
+
+    //tan(fov/2), half the width of the camera plane at distance 1
+    float tan_half() const {
+        return half;
+    }
+
+    void ray(int i, float& dx, float& dy) const {
+        dx = dir_x + plane_x * offsets[i];
+        dy = dir_y + plane_y * offsets[i];
+    }
+
+    //project the n points (x[i],y[i]) seen from (ox,oy), see project_points_scalar. the view spans u in
+    //[-1, 1], column i of the view is at u = 2i/columns()-1
+    void project(float ox, float oy, const float* x, const float* y, int n, float* depth, float* u) const {
+        static const ProjectPointsFn impl = select_project_points();
+        impl(ox, oy, dir_x, dir_y, plane_x, plane_y, half, x, y, n, depth, u);
+    }
+};
@@ -0,0 +1,6 @@
+//the single translation unit holding the stb_image and stb_image_write implementations,
+//every other file only includes the headers
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
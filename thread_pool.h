@@ -0,0 +1,115 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//A fixed set of worker threads that live for the whole run of the program. The pool is used to
+//split per-frame work such as the column loop of the 3D view into strips that are processed in
+//parallel; parallel_for returns only after every strip is done, so it doubles as a frame barrier.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    //the job currently being run, only valid while busy > 0 or the caller is inside parallel_for.
+    //the callable is kept as a plain pointer plus a function that knows its type, so starting a
+    //job never allocates the way wrapping a capturing lambda in a std::function would.
+    void* job = nullptr;
+    void (*job_call)(void*, int, int) = nullptr;
+    int job_n = 0;
+    int job_grain = 1;
+    std::atomic<int> next_strip{0};
+    int strip_cnt = 0;
+
+    uint64_t generation = 0; //incremented for every parallel_for call to wake the workers
+    int busy = 0;            //workers that have not finished the current generation yet
+    bool stopping = false;
+
+    //grab strips until none are left
+    void run_strips() {
+        for (;;) {
+            int s = next_strip.fetch_add(1);
+            if (s >= strip_cnt) break;
+            int begin = s * job_grain;
+            int end = std::min(job_n, begin + job_grain);
+            job_call(job, begin, end);
+        }
+    }
+
+    void worker_loop() {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                work_cv.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            run_strips();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (--busy == 0) done_cv.notify_one();
+            }
+        }
+    }
+public:
+    //threads is the total amount of threads working on a job including the caller of parallel_for,
+    //so a pool of 1 runs everything on the calling thread. 0 picks the hardware concurrency.
+    explicit ThreadPool(int threads = 0) {
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return int(workers.size()) + 1;
+    }
+
+    //split [0, n) into strips of grain items and call fn(begin, end) for every strip. strips are
+    //handed out dynamically so uneven strips balance out. blocks until all strips are finished.
+    template <typename Fn>
+    void parallel_for(int n, int grain, Fn&& fn) {
+        if (n <= 0) return;
+        grain = std::max(1, grain);
+        if (workers.empty() || n <= grain) {
+            for (int begin = 0; begin < n; begin += grain) fn(begin, std::min(n, begin + grain));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job = (void*)&fn;
+            job_call = [](void* f, int begin, int end) { (*(std::remove_reference_t<Fn>*)f)(begin, end); };
+            job_n = n;
+            job_grain = grain;
+            strip_cnt = (n + grain - 1) / grain;
+            next_strip = 0;
+            busy = int(workers.size());
+            ++generation;
+        }
+        work_cv.notify_all();
+        run_strips();
+        std::unique_lock<std::mutex> lock(mtx);
+        done_cv.wait(lock, [&] { return busy == 0; });
+        job = nullptr;
+        job_call = nullptr;
+    }
+};